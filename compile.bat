@@ -1,7 +1,13 @@
 call "C:\Program Files (x86)\Microsoft Visual Studio\2022\BuildTools\VC\Auxiliary\Build\vcvars64.bat"
 
 cl /EHsc /std:c++17 /openmp /O2 dbpf-recompress.cpp
+cl /EHsc /std:c++17 /openmp /O2 qfs-bench.cpp
+cl /EHsc /std:c++17 /openmp /O2 dbpf-gen.cpp
+cl /EHsc /std:c++17 /openmp /O2 dbpf-bench.cpp
 
 del dbpf-recompress.obj
+del qfs-bench.obj
+del dbpf-gen.obj
+del dbpf-bench.obj
 
 pause
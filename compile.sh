@@ -0,0 +1,7 @@
+#!/bin/sh
+#compiles the tools on Linux with GCC, run from the folder of the source files
+
+g++ -std=c++17 -fopenmp -O2 dbpf-recompress.cpp -o dbpf-recompress
+g++ -std=c++17 -fopenmp -O2 qfs-bench.cpp -o qfs-bench
+g++ -std=c++17 -fopenmp -O2 dbpf-gen.cpp -o dbpf-gen
+g++ -std=c++17 -fopenmp -O2 dbpf-bench.cpp -o dbpf-bench
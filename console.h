@@ -0,0 +1,57 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+//the tools are written with wmain and wcout, so that file names with any characters can be used on Windows
+//on other systems main sets the locale for wcout and converts the arguments to wide strings the same way as the file names, before calling wmain
+
+#include "dbpf.h"
+
+#ifdef _WIN32
+	#include <fcntl.h>
+	#include <io.h>
+#else
+	#include <clocale>
+	#include <cstdlib>
+	#include <filesystem>
+	#include <string>
+	#include <vector>
+#endif
+
+//called at the start of wmain
+inline void initConsole() {
+#ifdef _WIN32
+	_setmode(_fileno(stdout), _O_U16TEXT); //fix for wcout
+#endif
+}
+
+#ifndef _WIN32
+
+int wmain(int argc, wchar_t* argv[]);
+
+int main(int argc, char* argv[]) {
+	//wcout can't print characters outside of ASCII in the C locale, use UTF-8 if the environment doesn't set a locale
+	//only the character type is taken from the environment, so that numbers are printed the same everywhere
+	setlocale(LC_CTYPE, "");
+
+	if(MB_CUR_MAX == 1) {
+		setlocale(LC_CTYPE, "C.UTF-8");
+	}
+
+	std::vector<std::wstring> args;
+	std::vector<wchar_t*> argp;
+
+	for(int i = 0; i < argc; i++) {
+		args.push_back(dbpf::toWString(std::filesystem::path(argv[i])));
+	}
+
+	for(auto& arg: args) {
+		argp.push_back(&arg[0]);
+	}
+
+	argp.push_back(NULL);
+	return wmain(argc, argp.data());
+}
+
+#endif
+
+#endif
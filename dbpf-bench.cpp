@@ -0,0 +1,272 @@
+#include "console.h"
+#include "dbpf.h"
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//runs the whole recompress, validate, decompress, validate pipeline of dbpf-recompress on packages with 1 to N threads
+//the packages are left as they are, the outputs go to temporary files
+//reports the time of each phase for every thread count and the speedup over one thread
+
+enum Phase { INDEX, RECOMPRESS, VALIDATE_RECOMPRESS, DECOMPRESS, VALIDATE_DECOMPRESS, PHASE_COUNT };
+
+const wchar_t* const PHASE_NAMES[PHASE_COUNT] = {L"index", L"recompress", L"validate", L"decompress", L"validate"};
+
+double getSeconds(chrono::steady_clock::time_point start) {
+	return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+//adds the time of each phase to seconds, returns false if the package could not be processed
+bool runPipeline(wstring fileName, wstring displayPath, wstring tempName, dbpf::Options& options, double seconds[PHASE_COUNT]) {
+	wstring compressedName = tempName + L".recompressed";
+	wstring decompressedName = tempName + L".decompressed";
+
+	fstream file = fstream(dbpf::toPath(fileName), ios::in | ios::binary);
+
+	if(!file.is_open()) {
+		wcout << displayPath << L": Failed to open file" << endl;
+		return false;
+	}
+
+	auto start = chrono::steady_clock::now();
+	dbpf::InputFile input = dbpf::InputFile(file, fileName);
+	dbpf::Package package = dbpf::getPackage(input, displayPath, dbpf::RECOMPRESS);
+	dbpf::Package oldPackage = package; //copy
+	seconds[INDEX] += getSeconds(start);
+
+	if(!package.unpacked) {
+		return false;
+	}
+
+	fstream compressedFile = fstream(dbpf::toPath(compressedName), ios::in | ios::out | ios::binary | ios::trunc);
+	fstream decompressedFile = fstream(dbpf::toPath(decompressedName), ios::in | ios::out | ios::binary | ios::trunc);
+
+	if(!compressedFile.is_open() || !decompressedFile.is_open()) {
+		wcout << displayPath << L": Failed to create temp file" << endl;
+		return false;
+	}
+
+	start = chrono::steady_clock::now();
+	dbpf::OutputFile compressedOutput = dbpf::OutputFile(compressedFile, compressedName);
+	bool is_verified = dbpf::putPackage(compressedOutput, input, package, dbpf::RECOMPRESS, options);
+	dbpf::copyHashes(package, oldPackage);
+	compressedOutput.close();
+	is_verified = is_verified && compressedOutput.good();
+	seconds[RECOMPRESS] += getSeconds(start);
+
+	start = chrono::steady_clock::now();
+	dbpf::InputFile compressedInput = dbpf::InputFile(compressedFile, compressedName);
+	dbpf::Package compressedPackage = dbpf::getPackage(compressedInput, compressedName, dbpf::RECOMPRESS);
+	bool is_valid = is_verified && dbpf::validatePackage(oldPackage, compressedPackage, input, compressedInput, displayPath, dbpf::RECOMPRESS, options);
+	seconds[VALIDATE_RECOMPRESS] += getSeconds(start);
+
+	//validation marks the entries as decompressed, so the package is read again like dbpf-recompress -d would
+	if(is_valid) {
+		start = chrono::steady_clock::now();
+		package = dbpf::getPackage(compressedInput, compressedName, dbpf::DECOMPRESS);
+		compressedPackage = package; //copy
+		dbpf::OutputFile decompressedOutput = dbpf::OutputFile(decompressedFile, decompressedName);
+		is_valid = dbpf::putPackage(decompressedOutput, compressedInput, package, dbpf::DECOMPRESS, options);
+		dbpf::copyHashes(package, compressedPackage);
+		decompressedOutput.close();
+		is_valid = is_valid && decompressedOutput.good();
+		seconds[DECOMPRESS] += getSeconds(start);
+
+		start = chrono::steady_clock::now();
+		dbpf::InputFile decompressedInput = dbpf::InputFile(decompressedFile, decompressedName);
+		dbpf::Package decompressedPackage = dbpf::getPackage(decompressedInput, decompressedName, dbpf::DECOMPRESS);
+		is_valid = is_valid && dbpf::validatePackage(compressedPackage, decompressedPackage, compressedInput, decompressedInput, displayPath, dbpf::DECOMPRESS, options);
+		seconds[VALIDATE_DECOMPRESS] += getSeconds(start);
+	}
+
+	//the temporary files can't be deleted while they are mapped
+	input.close();
+	compressedInput.close();
+	compressedOutput.close();
+	file.close();
+	compressedFile.close();
+	decompressedFile.close();
+
+	filesystem::remove(dbpf::toPath(compressedName));
+	filesystem::remove(dbpf::toPath(decompressedName));
+
+	return is_valid;
+}
+
+int wmain(int argc, wchar_t *argv[]) {
+	initConsole();
+
+	if(argc == 1) {
+		wcout << L"dbpf-bench.exe -args package_file_or_folder" << endl;
+		wcout << L"  -l  compression level, 1 to 9 or max (default: " << QFS_DEFAULT_LEVEL << L")" << endl;
+		wcout << L"  -e  compression engine, chain, optimal, fast, or bt (default: chain)" << endl;
+		wcout << L"  -c  validation, fused, hash, or full (default: hash)" << endl;
+		wcout << L"  -t  maximum number of threads (default: number of cores)" << endl;
+		wcout << endl;
+		return 0;
+	}
+
+	dbpf::Options options;
+	options.cacheSize = 0; //every package is compressed once for each thread count, the cache would only time the first one
+	int maxThreads = omp_get_num_procs();
+	int fileArgIndex = 1;
+
+	while(fileArgIndex < argc - 1 && argv[fileArgIndex][0] == L'-') {
+		wstring arg = argv[fileArgIndex];
+		wstring value = argv[++fileArgIndex];
+
+		if(arg == L"-l") {
+			if(value == L"max") {
+				options.level = QFS_MAX_LEVEL;
+			} else if(value.size() == 1 && value[0] >= L'0' + QFS_MIN_LEVEL && value[0] <= L'9') {
+				options.level = value[0] - L'0';
+			} else {
+				wcout << L"Invalid compression level " << value << endl;
+				return 0;
+			}
+
+		} else if(arg == L"-e") {
+			if(value == L"chain") {
+				options.engine = QFS_ENGINE_CHAIN;
+			} else if(value == L"optimal") {
+				options.engine = QFS_ENGINE_OPTIMAL;
+			} else if(value == L"fast") {
+				options.engine = QFS_ENGINE_FAST;
+			} else if(value == L"bt") {
+				options.engine = QFS_ENGINE_OPTIMAL_BT;
+			} else {
+				wcout << L"Invalid compression engine " << value << endl;
+				return 0;
+			}
+
+		} else if(arg == L"-c") {
+			if(value == L"fused") {
+				options.validation = dbpf::VALIDATE_FUSED;
+			} else if(value == L"hash") {
+				options.validation = dbpf::VALIDATE_HASH;
+			} else if(value == L"full") {
+				options.validation = dbpf::VALIDATE_FULL;
+			} else {
+				wcout << L"Invalid validation " << value << endl;
+				return 0;
+			}
+
+		} else if(arg == L"-t") {
+			maxThreads = wcstol(value.c_str(), nullptr, 10);
+
+			if(maxThreads < 1) {
+				wcout << L"Invalid number of threads " << value << endl;
+				return 0;
+			}
+
+		} else {
+			wcout << L"Unknown argument " << arg << endl;
+			return 0;
+		}
+
+		fileArgIndex++;
+	}
+
+	wstring pathName = argv[fileArgIndex];
+	vector<filesystem::directory_entry> files;
+
+	if(filesystem::is_regular_file(dbpf::toPath(pathName))) {
+		files.push_back(filesystem::directory_entry(dbpf::toPath(pathName)));
+
+	} else if(filesystem::is_directory(dbpf::toPath(pathName))) {
+		for(auto& dir_entry: filesystem::recursive_directory_iterator(dbpf::toPath(pathName))) {
+			if(dir_entry.is_regular_file() && dir_entry.path().extension() == ".package") {
+				files.push_back(dir_entry);
+			}
+		}
+
+	} else {
+		wcout << L"File not found" << endl;
+		return 0;
+	}
+
+	//read every file once so that the first thread count doesn't pay for the disk
+	unsigned long long totalSize = 0;
+
+	for(auto& dir_entry: files) {
+		wstring fileName = dbpf::toWString(dir_entry.path());
+		fstream file = fstream(dbpf::toPath(fileName), ios::in | ios::binary);
+		bytes buffer = bytes(1024 * 1024);
+
+		while(file.read(reinterpret_cast<char*>(buffer.data()), buffer.size()) || file.gcount() > 0) {
+			totalSize += file.gcount();
+		}
+	}
+
+	wcout << files.size() << L" packages, " << fixed << setprecision(2) << totalSize / 1024.0 / 1024.0 << L" MB" << endl << endl;
+
+	//1, 2, 4, ... threads up to the maximum
+	vector<int> threadCounts;
+
+	for(int threads = 1; threads < maxThreads; threads *= 2) {
+		threadCounts.push_back(threads);
+	}
+
+	threadCounts.push_back(maxThreads);
+
+	wcout << L"threads";
+
+	for(int i = 0; i < PHASE_COUNT; i++) {
+		wcout << setw(12) << PHASE_NAMES[i];
+	}
+
+	wcout << setw(12) << L"total" << setw(10) << L"MB/s" << setw(10) << L"speedup" << endl;
+
+	wstring tempName = dbpf::toWString(filesystem::temp_directory_path() / L"dbpf-bench");
+	double baseline = 0;
+	uint failures = 0;
+
+	for(int threads: threadCounts) {
+		omp_set_num_threads(threads);
+		double seconds[PHASE_COUNT] = {};
+
+		for(auto& dir_entry: files) {
+			wstring fileName = dbpf::toWString(dir_entry.path());
+			wstring displayPath = dbpf::toWString(dir_entry.path().filename());
+
+			if(!runPipeline(fileName, displayPath, tempName, options, seconds)) {
+				failures++;
+			}
+		}
+
+		double total = 0;
+
+		for(int i = 0; i < PHASE_COUNT; i++) {
+			total += seconds[i];
+		}
+
+		if(threads == 1) {
+			baseline = total;
+		}
+
+		wcout << setw(7) << threads << setprecision(3);
+
+		for(int i = 0; i < PHASE_COUNT; i++) {
+			wcout << setw(12) << seconds[i];
+		}
+
+		wcout << setw(12) << total << setprecision(1) << setw(10) << totalSize / total / 1024 / 1024;
+		wcout << setprecision(2) << setw(9) << baseline / total << L"x" << endl;
+	}
+
+	wcout << endl;
+
+	if(failures > 0) {
+		wcout << failures << L" failed runs" << endl;
+		return 1;
+	}
+
+	return 0;
+}
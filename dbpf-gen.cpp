@@ -0,0 +1,351 @@
+#include "console.h"
+#include "dbpf.h"
+
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//writes synthetic Sims 2 package files for testing and benchmarking the compressor at scale
+//the entries have random content with the given entropy, some of them are already compressed and listed in a CLST,
+//some of them repeat the TGIR of another entry, and the package has holes of junk data between the entries
+
+//types of common Sims 2 resources
+const uint TYPES[] = {
+	0xAC4F8687, //GMDC
+	0x7BA3838C, //GMND
+	0xE519C933, //CRES
+	0xFC6EB1F7, //SHPE
+	0x1C4A276C, //TXTR
+	0x49596978, //TXMT
+	0x53545223, //STR#
+	0x4F424A44, //OBJD
+	0x42484156, //BHAV
+};
+
+enum SizeDistribution { SMALL, MIXED, LARGE };
+
+struct GeneratorOptions {
+	uint entries = 100;
+	SizeDistribution sizes = MIXED;
+	double entropy = 4; //bits per byte
+	uint compressedPercent = 50;
+	uint repeatedPercent = 1;
+	uint holes = 2;
+	uint indexMinorVersion = 1;
+	uint seed = 1;
+};
+
+//entry sizes are spread evenly on a log scale between the bounds of the distribution
+uint getEntrySize(SizeDistribution sizes, mt19937& random) {
+	double minSize, maxSize;
+
+	if(sizes == SMALL) {
+		minSize = 64; maxSize = 16 * 1024;
+	} else if(sizes == LARGE) {
+		minSize = 256 * 1024; maxSize = 4 * 1024 * 1024;
+	} else {
+		minSize = 64; maxSize = 1024 * 1024;
+	}
+
+	uniform_real_distribution<double> distribution(log(minSize), log(maxSize));
+	return (uint) exp(distribution(random));
+}
+
+//bytes drawn evenly from an alphabet of 2^entropy symbols
+bytes getContent(uint size, double entropy, mt19937& random) {
+	uint alphabet = (uint) round(pow(2.0, entropy));
+	uniform_int_distribution<uint> distribution(0, alphabet > 0 ? alphabet - 1 : 0);
+
+	bytes content = bytes(size);
+
+	for(auto& c: content) {
+		c = distribution(random);
+	}
+
+	return content;
+}
+
+//returns false if the file couldn't be written
+bool generatePackage(wstring fileName, GeneratorOptions& options) {
+	mt19937 random(options.seed);
+	uniform_int_distribution<uint> percent(0, 99);
+	uniform_int_distribution<uint> any;
+
+	//TGIRs, then the entries that are compressed in the package
+	vector<dbpf::Entry> entries;
+	entries.reserve(options.entries + 1);
+
+	for(uint i = 0; i < options.entries; i++) {
+		dbpf::Entry entry = dbpf::Entry{TYPES[any(random) % (sizeof(TYPES) / sizeof(TYPES[0]))], any(random), i, 0, 0, 0};
+
+		if(options.indexMinorVersion == 2) {
+			entry.resource = any(random);
+		}
+
+		//repeated TGIRs can't be compressed, the CLST would apply to both entries
+		if(i > 0 && percent(random) < options.repeatedPercent) {
+			dbpf::Entry& other = entries[any(random) % i];
+			entry.type = other.type;
+			entry.group = other.group;
+			entry.instance = other.instance;
+			entry.resource = other.resource;
+			entry.repeated = other.repeated = true;
+		}
+
+		entries.push_back(entry);
+	}
+
+	for(auto& entry: entries) {
+		entry.compressed = !entry.repeated && percent(random) < options.compressedPercent;
+	}
+
+	//holes go after random entries
+	vector<uint> holeAfter;
+
+	for(uint i = 0; i < options.holes; i++) {
+		holeAfter.push_back(options.entries > 0 ? any(random) % options.entries : 0);
+	}
+
+	fstream file = fstream(dbpf::toPath(fileName), ios::out | ios::binary | ios::trunc);
+
+	if(!file.is_open()) {
+		return false;
+	}
+
+	//header, written again at the end with the index information
+	bytes buffer = bytes(96);
+	dbpf::writeFile(file, buffer);
+
+	unsigned long long location = 96;
+	vector<dbpf::Hole> holes;
+	qfs_context context;
+
+	auto putHoles = [&](uint i) {
+		for(uint after: holeAfter) {
+			if(after == i) {
+				//8 byte holes would look like a compressor signature
+				uint size = 16 + any(random) % 1024;
+				bytes junk = getContent(size, 8, random);
+
+				holes.push_back(dbpf::Hole{(uint) location, size});
+				dbpf::writeFile(file, junk);
+				location += size;
+			}
+		}
+	};
+
+	for(uint i = 0; i < entries.size(); i++) {
+		auto& entry = entries[i];
+		bytes content = getContent(getEntrySize(options.sizes, random), options.entropy, random);
+
+		if(entry.compressed) {
+			bytes compressedContent = bytes(content.size());
+			int length = qfs_compress(context, content.data(), content.size(), compressedContent.data(), QFS_MIN_LEVEL, QFS_ENGINE_FAST);
+
+			if(length > 0) {
+				compressedContent.resize(length);
+				entry.uncompressedSize = content.size();
+				content = compressedContent;
+			} else {
+				entry.compressed = false;
+			}
+		}
+
+		entry.location = location;
+		entry.size = content.size();
+		dbpf::writeFile(file, content);
+		location += content.size();
+
+		putHoles(i);
+	}
+
+	//directory of compressed files
+	uint recordSize = options.indexMinorVersion == 2 ? 4 * 5 : 4 * 4;
+	bytes clstContent = bytes(entries.size() * recordSize);
+	uint pos = 0;
+
+	for(auto& entry: entries) {
+		if(entry.compressed) {
+			dbpf::putInt(clstContent, pos, entry.type);
+			dbpf::putInt(clstContent, pos, entry.group);
+			dbpf::putInt(clstContent, pos, entry.instance);
+
+			if(options.indexMinorVersion == 2) {
+				dbpf::putInt(clstContent, pos, entry.resource);
+			}
+
+			dbpf::putInt(clstContent, pos, entry.uncompressedSize);
+		}
+	}
+
+	if(pos > 0) {
+		clstContent.resize(pos);
+		entries.push_back(dbpf::Entry{0xE86B1EEF, 0xE86B1EEF, 0x286B1F03, 0, (uint) location, pos});
+		dbpf::writeFile(file, clstContent);
+		location += pos;
+	}
+
+	//index
+	uint indexLocation = location;
+	buffer = bytes(entries.size() * (recordSize + 4));
+	pos = 0;
+
+	for(auto& entry: entries) {
+		dbpf::putInt(buffer, pos, entry.type);
+		dbpf::putInt(buffer, pos, entry.group);
+		dbpf::putInt(buffer, pos, entry.instance);
+
+		if(options.indexMinorVersion == 2) {
+			dbpf::putInt(buffer, pos, entry.resource);
+		}
+
+		dbpf::putInt(buffer, pos, entry.location);
+		dbpf::putInt(buffer, pos, entry.size);
+	}
+
+	dbpf::writeFile(file, buffer);
+	location += buffer.size();
+
+	//hole index
+	uint holeIndexLocation = location;
+	buffer = bytes(holes.size() * 8);
+	pos = 0;
+
+	for(auto& hole: holes) {
+		dbpf::putInt(buffer, pos, hole.location);
+		dbpf::putInt(buffer, pos, hole.size);
+	}
+
+	dbpf::writeFile(file, buffer);
+	location += buffer.size();
+
+	//locations in the index are 32 bits
+	if(location > 0xFFFFFFFF) {
+		wcout << fileName << L": Package would be larger than 4 GB" << endl;
+		file.close();
+		filesystem::remove(dbpf::toPath(fileName));
+		return false;
+	}
+
+	buffer = bytes(96);
+	pos = 0;
+
+	dbpf::putInt(buffer, pos, dbpf::DBPF_MAGIC);
+	dbpf::putInt(buffer, pos, 1); //major version
+	dbpf::putInt(buffer, pos, 1); //minor version
+	pos += 4 * 5; //user versions, flags, and dates
+	dbpf::putInt(buffer, pos, 7); //index major version
+	dbpf::putInt(buffer, pos, entries.size());
+	dbpf::putInt(buffer, pos, indexLocation);
+	dbpf::putInt(buffer, pos, holeIndexLocation - indexLocation);
+	dbpf::putInt(buffer, pos, holes.size());
+	dbpf::putInt(buffer, pos, holeIndexLocation);
+	dbpf::putInt(buffer, pos, holes.size() * 8);
+	dbpf::putInt(buffer, pos, options.indexMinorVersion);
+
+	file.seekp(0);
+	dbpf::writeFile(file, buffer);
+
+	bool success = file.good();
+	file.close();
+	return success;
+}
+
+//parse an unsigned integer argument, returns false if it's not a number
+bool getUint(wstring value, uint& n) {
+	if(value.empty() || value.find_first_not_of(L"0123456789") != wstring::npos) {
+		return false;
+	}
+
+	n = wcstoul(value.c_str(), nullptr, 10);
+	return true;
+}
+
+int wmain(int argc, wchar_t *argv[]) {
+	initConsole();
+
+	if(argc == 1) {
+		wcout << L"dbpf-gen.exe -args output_file" << endl;
+		wcout << L"  -n  number of entries (default: 100)" << endl;
+		wcout << L"  -s  entry sizes, small (64 B to 16 KB), mixed (64 B to 1 MB), or large (256 KB to 4 MB) (default: mixed)" << endl;
+		wcout << L"  -e  entropy of the content in bits per byte, 0 to 8 (default: 4)" << endl;
+		wcout << L"  -c  percentage of entries that are stored compressed (default: 50)" << endl;
+		wcout << L"  -d  percentage of entries that repeat the TGIR of another entry (default: 1)" << endl;
+		wcout << L"  -h  number of holes (default: 2)" << endl;
+		wcout << L"  -i  index minor version, 1 or 2 (default: 1)" << endl;
+		wcout << L"  -r  random seed (default: 1)" << endl;
+		wcout << endl;
+		return 0;
+	}
+
+	GeneratorOptions options;
+	int fileArgIndex = 1;
+
+	while(fileArgIndex < argc - 1 && argv[fileArgIndex][0] == L'-') {
+		wstring arg = argv[fileArgIndex];
+		wstring value = argv[++fileArgIndex];
+		bool valid = true;
+
+		if(arg == L"-n") {
+			valid = getUint(value, options.entries);
+
+		} else if(arg == L"-s") {
+			if(value == L"small") {
+				options.sizes = SMALL;
+			} else if(value == L"mixed") {
+				options.sizes = MIXED;
+			} else if(value == L"large") {
+				options.sizes = LARGE;
+			} else {
+				valid = false;
+			}
+
+		} else if(arg == L"-e") {
+			options.entropy = wcstod(value.c_str(), nullptr);
+			valid = options.entropy >= 0 && options.entropy <= 8;
+
+		} else if(arg == L"-c") {
+			valid = getUint(value, options.compressedPercent) && options.compressedPercent <= 100;
+
+		} else if(arg == L"-d") {
+			valid = getUint(value, options.repeatedPercent) && options.repeatedPercent <= 100;
+
+		} else if(arg == L"-h") {
+			valid = getUint(value, options.holes);
+
+		} else if(arg == L"-i") {
+			valid = getUint(value, options.indexMinorVersion) && (options.indexMinorVersion == 1 || options.indexMinorVersion == 2);
+
+		} else if(arg == L"-r") {
+			valid = getUint(value, options.seed);
+
+		} else {
+			wcout << L"Unknown argument " << arg << endl;
+			return 0;
+		}
+
+		if(!valid) {
+			wcout << L"Invalid value " << value << L" for " << arg << endl;
+			return 0;
+		}
+
+		fileArgIndex++;
+	}
+
+	wstring fileName = argv[fileArgIndex];
+
+	if(!generatePackage(fileName, options)) {
+		wcout << fileName << L": Failed to write package" << endl;
+		return 1;
+	}
+
+	wcout << fileName << L" " << options.entries << L" entries, " << fixed << setprecision(2) << filesystem::file_size(dbpf::toPath(fileName)) / 1024.0 / 1024.0 << L" MB" << endl;
+	return 0;
+}
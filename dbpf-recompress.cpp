@@ -1,28 +1,422 @@
+#include "console.h"
 #include "dbpf.h"
 
-#include <fcntl.h>
-#include <io.h>
-
+#include <algorithm>
+#include <condition_variable>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 using namespace std;
 
-bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstream& oldFile, fstream& newFile, wstring displayPath, dbpf::Mode mode);
+//size, time of the last change, and inode of a file, a file that still has the same id as in the manifest has not changed since it was processed
+struct FileId {
+	unsigned long long size = 0;
+	long long mtime = 0;
+	unsigned long long inode = 0;
+	
+	bool operator==(const FileId& other) const {
+		return size == other.size && mtime == other.mtime && inode == other.inode;
+	}
+};
+
+//get the id of a file with one stat, or from the directory listing on Windows, which has no inodes that can be read without opening the file
+FileId getFileId(const filesystem::directory_entry& entry) {
+	FileId id;
+	
+#ifdef _WIN32
+	id.size = entry.file_size();
+	id.mtime = entry.last_write_time().time_since_epoch().count();
+#else
+	struct stat st;
+	
+	if(stat(entry.path().c_str(), &st) == 0) {
+		id.size = st.st_size;
+		id.mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+		id.inode = st.st_ino;
+	}
+#endif
+	
+	return id;
+}
+
+/*packages that were already processed, kept in a file between runs so that a package that has not changed since is skipped with one stat and never opened
+each line is the id of the file, the signature that it had when it was done, and its path:
+	size mtime inode signature path
+the signature is 0 for a package that was decompressed*/
+class Manifest {
+	private:
+		struct Record {
+			FileId id;
+			uint signature;
+			bool seen; //packages that weren't seen in this run were deleted or moved, they are dropped when the manifest is saved
+		};
+		
+		wstring fileName;
+		unordered_map<wstring, Record> records;
+		mutex m;
+		
+	public:
+		//read the manifest, an empty fileName or a missing file is an empty manifest
+		void load(wstring fileName_) {
+			fileName = fileName_;
+			
+			if(fileName.empty()) {
+				return;
+			}
+			
+			ifstream file = ifstream(dbpf::toPath(fileName), ios::binary);
+			string line;
+			
+			while(getline(file, line)) {
+				istringstream in = istringstream(line);
+				Record record = Record{FileId(), 0, false};
+				
+				if(in >> record.id.size >> record.id.mtime >> record.id.inode >> hex >> record.signature && in.get() == ' ') {
+					string path;
+					getline(in, path);
+					records[dbpf::toWString(filesystem::u8path(path))] = record;
+				}
+			}
+		}
+		
+		//true if the package at path has not changed since it was done with settings that don't need it to be processed again
+		bool isDone(wstring path, FileId id, dbpf::Mode mode, dbpf::Options& options) {
+			lock_guard<mutex> lock(m);
+			auto it = records.find(path);
+			
+			if(it == records.end() || !(it->second.id == id)) {
+				return false;
+			}
+			
+			it->second.seen = true;
+			dbpf::Options signatureOptions;
+			
+			if(mode == dbpf::DECOMPRESS) {
+				return it->second.signature == 0;
+			} else {
+				return it->second.signature != 0 && dbpf::getSignatureOptions(it->second.signature, signatureOptions) && dbpf::isCompressedWith(signatureOptions, options);
+			}
+		}
+		
+		void add(wstring path, FileId id, uint signature) {
+			if(fileName.empty()) {
+				return;
+			}
+			
+			lock_guard<mutex> lock(m);
+			records[path] = Record{id, signature, true};
+		}
+		
+		//write the manifest, returns false if it couldn't be written
+		bool save() {
+			if(fileName.empty()) {
+				return true;
+			}
+			
+			ofstream file = ofstream(dbpf::toPath(fileName), ios::binary | ios::trunc);
+			
+			for(auto& [path, record]: records) {
+				if(record.seen) {
+					file << record.id.size << ' ' << record.id.mtime << ' ' << record.id.inode << ' ' << hex << record.signature << dec << ' ' << dbpf::toPath(path).u8string() << '\n';
+				}
+			}
+			
+			return file.good();
+		}
+};
+
+//the manifest of a folder is kept in the folder, it's not a package so it's never processed itself
+const wchar_t* const MANIFEST_NAME = L"dbpf-recompress.manifest";
 
 //trys to delete a file, fails silently
 void tryDelete(wstring fileName) {
-	try { filesystem::remove(fileName); }
+	try { filesystem::remove(dbpf::toPath(fileName)); }
 	catch(filesystem::filesystem_error) {}
 }
 
-//using wide chars and wide strings to support UTF-16 file names
+//size in KB, or in MB if it's large
+void putSize(wostringstream& out, float size) {
+	if(size >= 1000) {
+		out << size / 1024.0 << L" MB";
+	} else {
+		out << size << L" KB";
+	}
+}
+
+//one package file from opening it to replacing it
+struct Job {
+	wstring fileName;
+	wstring tempFileName;
+	wstring displayPath; //for cout
+	float current_size;
+	dbpf::Mode mode;
+	
+	fstream file;
+	fstream tempFile;
+	unique_ptr<dbpf::InputFile> input;
+	bool is_mapped = false;
+	bool opened = false;
+	bool written = false;
+	bool is_verified = false;
+	
+	dbpf::Package package;
+	dbpf::Package oldPackage;
+	
+	//when the package is compressed together with the other packages of a batch, the old content of the entries and the new content that replaces it
+	bool prepared = false;
+	vector<bytes> buffers;
+	vector<dbpf::Span> oldContents;
+	vector<bytes> contents;
+	uint mismatches = 0;
+	
+	FileId id;
+	bool listed = false; //skipped because the manifest has it, the file is never opened
+	uint signature = 0; //signature of the package when it's done, 0 if it's decompressed
+	
+	wstring result;
+};
+
+/*queue between two stages of the pipeline
+push waits while the queue is full, so a stage that is ahead of the next one waits for it and only a few batches are in memory at once*/
+template<class T>
+class StageQueue {
+	private:
+		queue<T> items;
+		uint capacity;
+		bool closed = false;
+		mutex m;
+		condition_variable changed;
+		
+	public:
+		StageQueue(uint capacity_): capacity(capacity_) {}
+		
+		void push(T item) {
+			unique_lock<mutex> lock(m);
+			changed.wait(lock, [&]() { return items.size() < capacity; });
+			items.push(move(item));
+			changed.notify_all();
+		}
+		
+		//returns false once the queue is closed and empty
+		bool pop(T& item) {
+			unique_lock<mutex> lock(m);
+			changed.wait(lock, [&]() { return !items.empty() || closed; });
+			
+			if(items.empty()) {
+				return false;
+			}
+			
+			item = move(items.front());
+			items.pop();
+			changed.notify_all();
+			return true;
+		}
+		
+		//no more items will be pushed
+		void close() {
+			unique_lock<mutex> lock(m);
+			closed = true;
+			changed.notify_all();
+		}
+};
+
+//one entry of a package in a batch
+struct Task {
+	Job* job;
+	int entry;
+	uint size;
+};
+
+//open the package and read its index, returns false if it can't be processed
+//the mode of the job is changed to SKIP if there is nothing to do with the package
+bool openPackage(Job& job, dbpf::Options& options) {
+	job.file = fstream(dbpf::toPath(job.fileName), ios::in | ios::binary);
+	
+	if(!job.file.is_open()) {
+		dbpf::printError(job.displayPath, L"Failed to open file");
+		return false;
+	}
+	
+	job.input = make_unique<dbpf::InputFile>(job.file, job.fileName, options.io);
+	job.is_mapped = job.input->isMapped();
+	
+	//optimization: if the package file has the compressor's signature then skip it, unless it was compressed with a different engine or a lower level
+	//only the header and the holes are read to find the signature, the index is not read at all
+	dbpf::Options signatureOptions;
+	
+	if(job.mode == dbpf::RECOMPRESS && dbpf::probeSignature(*job.input, signatureOptions) && dbpf::isCompressedWith(signatureOptions, options)) {
+		job.mode = dbpf::SKIP;
+		job.signature = dbpf::getSignature(signatureOptions);
+		job.input->close();
+		job.file.close();
+		job.opened = true;
+		return true;
+	}
+	
+	//get package
+	job.package = dbpf::getPackage(*job.input, job.displayPath, job.mode);
+	job.oldPackage = job.package; //copy
+	
+	//error unpacking package, getPackage already prints an error so there is no need to print one here
+	if(!job.package.unpacked) {
+		job.input->close();
+		job.file.close();
+		return false;
+	}
+	
+	//optimization: for DECOMPRESS mode skip the package file if all of it's entries are decompressed
+	if(job.mode == dbpf::DECOMPRESS) {
+		bool all_entries_decompressed = true;
+		
+		for(auto& entry: job.package.entries) {
+			if(entry.compressed) {
+				all_entries_decompressed = false;
+				break;
+			}
+		}
+		
+		if(all_entries_decompressed) {
+			job.mode = dbpf::SKIP;
+		}
+	}
+	
+	if(job.mode == dbpf::SKIP) {
+		job.input->close();
+		job.file.close();
+	}
+	
+	job.opened = true;
+	return true;
+}
+
+//read all of the entries of a package, so that they can be compressed together with the entries of the other packages of the batch
+void readPackage(Job& job, dbpf::Options& options) {
+	job.oldContents = dbpf::readEntries(*job.input, job.package.entries, 0, job.package.entries.size(), job.buffers);
+	job.contents = vector<bytes>(job.package.entries.size());
+	job.prepared = true;
+}
+
+//write the package to the temp file, the entries are compressed by putPackage unless they were already compressed with the batch
+void writePackage(Job& job, dbpf::Options& options) {
+	job.tempFile = fstream(dbpf::toPath(job.tempFileName), ios::in | ios::out | ios::binary | ios::trunc);
+	
+	if(!job.tempFile.is_open()) {
+		dbpf::printError(job.displayPath, L"Failed to create temp file");
+		return;
+	}
+	
+	dbpf::OutputFile tempOutput = dbpf::OutputFile(job.tempFile, job.tempFileName, options.io);
+	
+	if(job.prepared) {
+		job.buffers.clear();
+		job.oldContents.clear();
+		
+		uint location = dbpf::writeEntries(tempOutput, job.package.entries, 0, job.package.entries.size(), job.contents, 96);
+		dbpf::putIndex(tempOutput, job.package, location, job.mode, options);
+		job.is_verified = job.mismatches == 0;
+	} else {
+		job.is_verified = dbpf::putPackage(tempOutput, *job.input, job.package, job.mode, options);
+	}
+	
+	dbpf::copyHashes(job.package, job.oldPackage);
+	
+	//the temp file is deleted by finishPackage and never replaces the old package if any part of it wasn't written
+	tempOutput.close();
+	
+	if(!tempOutput.good()) {
+		dbpf::printError(job.displayPath, L"Failed to write temp file");
+		job.is_verified = false;
+	} else if(!job.is_verified) {
+		dbpf::printError(job.displayPath, L"Mismatch between old entry and new entry");
+	}
+	
+	job.written = true;
+}
+
+//validate the new package and replace the old package with it, then add it to the manifest
+void finishPackage(Job& job, dbpf::Options& options, Manifest& manifest, bool verbose) {
+	if(job.mode != dbpf::SKIP) {
+		if(!job.written) {
+			writePackage(job, options);
+		}
+		
+		if(!job.tempFile.is_open()) {
+			job.input->close();
+			job.file.close();
+			return;
+		}
+		
+		//validate new file, a package that failed to be written or verified already has its error and is not read again
+		dbpf::InputFile tempInput = dbpf::InputFile(job.tempFile, job.tempFileName, options.io);
+		bool is_valid = false;
+		
+		if(job.is_verified) {
+			dbpf::Package newPackage = dbpf::getPackage(tempInput, job.tempFileName, job.mode);
+			is_valid = dbpf::validatePackage(job.oldPackage, newPackage, *job.input, tempInput, job.displayPath, job.mode, options);
+		}
+		
+		//the files can't be replaced or deleted while they are mapped
+		job.input->close();
+		tempInput.close();
+		job.file.close();
+		job.tempFile.close();
+		
+		if(!is_valid) {
+			tryDelete(job.tempFileName);
+			return;
+		}
+		
+		//overwrite old file
+		try {
+			filesystem::rename(dbpf::toPath(job.tempFileName), dbpf::toPath(job.fileName));
+		}
+		
+		catch(filesystem::filesystem_error) {
+			dbpf::printError(job.displayPath, L"Failed to overwrite file");
+			tryDelete(job.tempFileName);
+			return;
+		}
+		
+		job.id = getFileId(filesystem::directory_entry(dbpf::toPath(job.fileName)));
+		job.signature = job.mode == dbpf::RECOMPRESS ? dbpf::getSignature(options) : 0;
+	}
+	
+	if(!job.listed) {
+		manifest.add(job.displayPath, job.id, job.signature);
+	}
+	
+	float new_size = job.id.size / 1024.0;
+	
+	//output file size to console
+	wostringstream out;
+	out << job.displayPath << L" " << fixed << setprecision(2);
+	
+	putSize(out, job.current_size);
+	out << " -> ";
+	putSize(out, new_size);
+	out << endl;
+	
+	if(verbose && job.input) {
+		out << L"  " << job.input->getReads() << (job.input->getReads() == 1 ? L" read, " : L" reads, ");
+		putSize(out, job.input->getBytesRead() / 1024.0);
+		out << (job.is_mapped ? L" prefetched from the memory mapping" : L" read") << endl;
+	}
+	
+	job.result = out.str();
+}
+
 int wmain(int argc, wchar_t *argv[]) {
-	_setmode(_fileno(stdout), _O_U16TEXT); //fix for wcout
+	initConsole();
 	
 	if(argc == 1) {
 		wcout << L"No arguments provided" << endl;
@@ -35,16 +429,116 @@ int wmain(int argc, wchar_t *argv[]) {
 	if(arg == L"help") {
 		wcout << L"dbpf-recompress.exe -args package_file_or_folder" << endl;
 		wcout << L"  -d  decompress" << endl;
+		wcout << L"  -l  compression level, 1 to 9 or max (default: " << QFS_DEFAULT_LEVEL << L")" << endl;
+		wcout << L"  -e  compression engine, chain, optimal, fast, or bt (default: chain)" << endl;
+		wcout << L"  -c  validation, fused, hash, or full (default: hash)" << endl;
+		wcout << L"  -f  maximum number of packages that are open at the same time (default: 64)" << endl;
+		wcout << L"  -m  manifest of the packages that are done, or none (default: " << MANIFEST_NAME << L" in the folder, none for one package)" << endl;
+		wcout << L"  -k  file to keep the compression cache in between runs, or none to turn the cache off (default: the cache is only kept during the run)" << endl;
+		wcout << L"  -u  read and write the packages with io_uring (Linux only)" << endl;
+		wcout << L"  -v  show how many reads were made from each package and how much they read" << endl;
 		wcout << endl;
 		return 0;
 	}
 	
 	dbpf::Mode default_mode = dbpf::RECOMPRESS;
+	dbpf::Options options;
+	bool verbose = false;
+	uint maxOpenFiles = 64;
+	wstring manifestName;
+	wstring cacheName;
+	bool manifestGiven = false;
 	int fileArgIndex = 1;
 	
-	if(arg == L"-d") {
-		default_mode = dbpf::DECOMPRESS;
-		fileArgIndex = 2;
+	while(fileArgIndex < argc - 1 && argv[fileArgIndex][0] == L'-') {
+		arg = argv[fileArgIndex];
+		
+		if(arg == L"-d") {
+			default_mode = dbpf::DECOMPRESS;
+			
+		} else if(arg == L"-c") {
+			wstring value = argv[++fileArgIndex];
+			
+			if(value == L"fused") {
+				options.validation = dbpf::VALIDATE_FUSED;
+			} else if(value == L"hash") {
+				options.validation = dbpf::VALIDATE_HASH;
+			} else if(value == L"full") {
+				options.validation = dbpf::VALIDATE_FULL;
+			} else {
+				wcout << L"Invalid validation " << value << endl;
+				return 0;
+			}
+			
+		} else if(arg == L"-m") {
+			manifestName = argv[++fileArgIndex];
+			manifestGiven = true;
+			
+			if(manifestName == L"none") {
+				manifestName.clear();
+			}
+			
+		} else if(arg == L"-f") {
+			wstring value = argv[++fileArgIndex];
+			maxOpenFiles = wcstoul(value.c_str(), nullptr, 10);
+			
+			if(maxOpenFiles < 1) {
+				wcout << L"Invalid number of files " << value << endl;
+				return 0;
+			}
+			
+		} else if(arg == L"-k") {
+			cacheName = argv[++fileArgIndex];
+			
+			if(cacheName == L"none") {
+				cacheName.clear();
+				options.cacheSize = 0;
+			}
+			
+		} else if(arg == L"-u") {
+			options.io = dbpf::IO_URING;
+			
+			if(!uring::Ring().available()) {
+				wcout << L"io_uring is not available, the packages are read and written without it" << endl;
+			}
+			
+		} else if(arg == L"-v") {
+			verbose = true;
+			
+		} else if(arg == L"-l") {
+			wstring value = argv[++fileArgIndex];
+			
+			if(value == L"max") {
+				options.level = QFS_MAX_LEVEL;
+			} else if(value.size() == 1 && value[0] >= L'0' + QFS_MIN_LEVEL && value[0] <= L'9') {
+				options.level = value[0] - L'0';
+			} else {
+				wcout << L"Invalid compression level " << value << endl;
+				return 0;
+			}
+			
+		} else if(arg == L"-e") {
+			wstring value = argv[++fileArgIndex];
+			
+			if(value == L"chain") {
+				options.engine = QFS_ENGINE_CHAIN;
+			} else if(value == L"optimal") {
+				options.engine = QFS_ENGINE_OPTIMAL;
+			} else if(value == L"fast") {
+				options.engine = QFS_ENGINE_FAST;
+			} else if(value == L"bt") {
+				options.engine = QFS_ENGINE_OPTIMAL_BT;
+			} else {
+				wcout << L"Invalid compression engine " << value << endl;
+				return 0;
+			}
+			
+		} else {
+			wcout << L"Unknown argument " << arg << endl;
+			return 0;
+		}
+		
+		fileArgIndex++;
 	}
 	
 	if(fileArgIndex > argc - 1) {
@@ -57,8 +551,8 @@ int wmain(int argc, wchar_t *argv[]) {
 	auto files = vector<filesystem::directory_entry>();
 	bool is_dir = false;
 	
-	if(filesystem::is_regular_file(pathName)) {
-		auto file_entry = filesystem::directory_entry(pathName);
+	if(filesystem::is_regular_file(dbpf::toPath(pathName))) {
+		auto file_entry = filesystem::directory_entry(dbpf::toPath(pathName));
 		if(file_entry.path().extension() != ".package") {
 			wcout << L"Not a package file" << endl;
 			return 0;
@@ -66,9 +560,9 @@ int wmain(int argc, wchar_t *argv[]) {
 		
 		files.push_back(file_entry);
 		
-	} else if(filesystem::is_directory(pathName)) {
+	} else if(filesystem::is_directory(dbpf::toPath(pathName))) {
 		is_dir = true;
-		for(auto& dir_entry: filesystem::recursive_directory_iterator(pathName)) {
+		for(auto& dir_entry: filesystem::recursive_directory_iterator(dbpf::toPath(pathName))) {
 			if(dir_entry.is_regular_file() && dir_entry.path().extension() == ".package") {
 				files.push_back(dir_entry);
 			}
@@ -79,252 +573,234 @@ int wmain(int argc, wchar_t *argv[]) {
 		return 0;
 	}
 	
-	for(auto& dir_entry: files) {
-		auto mode = default_mode;
-		
-		//open file
-		wstring fileName = dir_entry.path().wstring();
-		wstring tempFileName = fileName + L".new";
-		
-		float current_size = dir_entry.file_size() / 1024.0;
-		
-		wstring displayPath; //for cout
-		
-		if(is_dir) {
-			displayPath = filesystem::relative(fileName, pathName).wstring();
-		} else {
-			displayPath = fileName;
-		}
-		
-		fstream file = fstream(fileName, ios::in | ios::binary);
-		
-		if(!file.is_open()) {
-			wcout << displayPath << L": Failed to open file" << endl;
-			continue;
-		}
-		
-		//get package
-		dbpf::Package package = dbpf::getPackage(file, displayPath, mode);
-		dbpf::Package oldPackage = package; //copy
-		
-		//optimization: if the package file has the compressor's signature then skip it
-		if(mode == dbpf::RECOMPRESS && package.signature_in_package) {
-			mode = dbpf::SKIP;
-			file.close();
-		}
-		
-		//error unpacking package, getPackage already prints an error so there is no need to print one here
-		if(!package.unpacked) {
-			file.close();
-			continue;
-		}
-		
-		//optimization: for DECOMPRESS mode skip the package file if all of it's entries are decompressed
-		if(mode == dbpf::DECOMPRESS) {
-			bool all_entries_decompressed = true;
+	Manifest manifest;
+	
+	if(!manifestGiven && is_dir) {
+		manifestName = dbpf::toWString(dbpf::toPath(pathName) / MANIFEST_NAME);
+	}
+	
+	manifest.load(manifestName);
+	
+	if(!cacheName.empty() && !dbpf::getCache().load(cacheName, options.cacheSize)) {
+		wcout << L"The compression cache " << cacheName << L" is damaged, only the entries before the damage are used" << endl;
+	}
+	
+	/*packages are processed in batches of packages with up to options.windowSize bytes in total, a package that is larger than the window is a batch of its own
+	the entries of the packages of a batch are compressed together, the largest entries first, so that folders of many small packages keep all of the cores busy
+	
+	the batches go through a pipeline of three stages that run at the same time:
+	reading: a thread opens the packages of the next batch, reads their index, and reads their entries or prefetches them from the memory mapping
+	compression: the main thread compresses the entries of the current batch, large packages are compressed, and written, by putPackage
+	writing: a thread writes the packages of the previous batch, validates them, and replaces the old packages
+	each stage holds one batch and the queues between them hold one batch each, so at most PIPELINE_BATCHES batches are open or in memory at once*/
+	const uint PIPELINE_BATCHES = 5;
+	uint batchFiles = max(1u, maxOpenFiles / PIPELINE_BATCHES);
+	
+	StageQueue<vector<Job>> readQueue = StageQueue<vector<Job>>(1);
+	StageQueue<vector<Job>> writeQueue = StageQueue<vector<Job>>(1);
+	
+	uint listedFiles = 0;
+	
+	thread reader = thread([&]() {
+		//packages that the manifest has are skipped, they don't count towards the size or the number of files of a batch
+		vector<FileId> ids = vector<FileId>(files.size());
+		vector<wstring> displayPaths = vector<wstring>(files.size());
+		vector<bool> listed = vector<bool>(files.size());
+		
+		for(uint i = 0; i < files.size(); i++) {
+			ids[i] = getFileId(files[i]);
 			
-			for(auto& entry: package.entries) {
-				if(entry.compressed) {
-					all_entries_decompressed = false;
-					break;
-				}
+			if(is_dir) {
+				displayPaths[i] = dbpf::toWString(filesystem::relative(files[i].path(), dbpf::toPath(pathName)));
+			} else {
+				displayPaths[i] = dbpf::toWString(files[i].path());
 			}
 			
-			if(all_entries_decompressed) {
-				mode = dbpf::SKIP;
-				file.close();
-			}
+			listed[i] = manifest.isDone(displayPaths[i], ids[i], default_mode, options);
+			listedFiles += listed[i];
 		}
 		
-		if(mode != dbpf::SKIP) {
-			//compress entries, pack package, and write to temp file
-			fstream tempFile = fstream(tempFileName, ios::in | ios::out | ios::binary | ios::trunc);
+		uint start = 0;
+		
+		while(start < files.size()) {
+			uint end = start;
+			uint count = 0;
+			unsigned long long batchSize = 0;
 			
-			if(tempFile.is_open()) {
-				dbpf::putPackage(tempFile, file, package, mode);
+			while(end < files.size() && count < batchFiles && (count == 0 || listed[end] || batchSize + ids[end].size <= options.windowSize)) {
+				if(!listed[end]) {
+					batchSize += ids[end].size;
+					count++;
+				}
 				
-			} else {
-				wcout << displayPath << L": Failed to create temp file" << endl;
-				file.close();
-				continue;
+				end++;
 			}
 			
-			//validate new file
-			tempFile.seekg(0, ios::beg);
-			dbpf::Package newPackage = dbpf::getPackage(tempFile, tempFileName, mode);
-			bool is_valid = validatePackage(oldPackage, newPackage, file, tempFile, displayPath, mode);
+			vector<Job> jobs = vector<Job>(end - start);
 			
-			file.close();
-			tempFile.close();
-			
-			if(!is_valid) {
-				tryDelete(tempFileName);
-				continue;
+			for(uint i = start; i < end; i++) {
+				Job& job = jobs[i - start];
+				job.fileName = dbpf::toWString(files[i].path());
+				job.tempFileName = job.fileName + L".new";
+				job.displayPath = displayPaths[i];
+				job.id = ids[i];
+				job.current_size = ids[i].size / 1024.0;
+				job.mode = default_mode;
+				
+				if(listed[i]) {
+					job.mode = dbpf::SKIP;
+					job.listed = true;
+					job.opened = true;
+					continue;
+				}
+				
+				//a package that is alone in its batch is read by putPackage
+				if(openPackage(job, options) && job.mode != dbpf::SKIP && count > 1) {
+					readPackage(job, options);
+				}
 			}
 			
-			float new_size = filesystem::file_size(tempFileName) / 1024.0;
-			
-			//overwrite old file
-			try {
-				filesystem::rename(tempFileName, fileName);
+			readQueue.push(move(jobs));
+			start = end;
+		}
+		
+		readQueue.close();
+	});
+	
+	//the packages are listed in order as they are finished
+	thread writer = thread([&]() {
+		//the writer validates and writes a batch while the main thread compresses the next one with a full team
+		//its teams are capped to a quarter of the processors (the setting only applies to this thread) so the cores aren't oversubscribed by two full teams
+		//validation is slower this way, but it's cheaper than compression so it's usually done before the next batch is compressed
+		omp_set_num_threads(max(1, omp_get_num_procs() / 4));
+		
+		vector<Job> jobs;
+		
+		while(writeQueue.pop(jobs)) {
+			for(auto& job: jobs) {
+				if(job.opened) {
+					finishPackage(job, options, manifest, verbose);
+					
+					#pragma omp critical(output)
+					wcout << job.result;
+				}
 			}
-			
-			catch(filesystem::filesystem_error) {
-				wcout << displayPath << L": Failed to overwrite file" << endl;
-				tryDelete(tempFileName);
-				continue;
+		}
+	});
+	
+	vector<Job> jobs;
+	
+	while(readQueue.pop(jobs)) {
+		//a package that is alone in its batch wasn't read with the batch
+		for(auto& job: jobs) {
+			if(job.opened && job.mode != dbpf::SKIP && !job.prepared) {
+				writePackage(job, options);
 			}
 		}
 		
-		float new_size = filesystem::file_size(fileName) / 1024.0;
+		//every entry of the batch, largest first so that the last ones to finish are small
+		vector<Task> tasks;
 		
-		//output file size to console
-		wcout << displayPath << L" " << fixed << setprecision(2);
-		
-		if(current_size >= 1000) {
-			wcout << current_size / 1024.0 << L" MB";
-		} else {
-			wcout << current_size << L" KB";
+		for(auto& job: jobs) {
+			for(int i = 0; i < job.contents.size(); i++) {
+				auto& entry = job.package.entries[i];
+				tasks.push_back(Task{&job, i, entry.compressed ? entry.uncompressedSize : entry.size});
+			}
 		}
 		
-		wcout << " -> ";
+		stable_sort(tasks.begin(), tasks.end(), [](const Task& a, const Task& b) {
+			return a.size > b.size;
+		});
 		
-		if(new_size >= 1000) {
-			wcout << new_size / 1024.0 << L" MB";
-		} else {
-			wcout << new_size << L" KB";
+		#pragma omp parallel for schedule(dynamic)
+		for(int i = 0; i < tasks.size(); i++) {
+			Job& job = *tasks[i].job;
+			int index = tasks[i].entry;
+			bool verified = true;
+			
+			job.contents[index] = dbpf::putEntry(job.package.entries[index], job.oldContents[index], job.mode, options, verified);
+			
+			if(!verified) {
+				#pragma omp atomic
+				job.mismatches++;
+			}
 		}
 		
-		wcout << endl;
+		writeQueue.push(move(jobs));
 	}
 	
-	wcout << endl;
-	return 0;
-}
-
-//checks if the new package file is valid
-bool validatePackage(dbpf::Package& oldPackage, dbpf::Package& newPackage, fstream& oldFile, fstream& newFile, wstring displayPath, dbpf::Mode mode) {
-	//package unpacking failed, getPackage already prints an error
-	if(!newPackage.unpacked) {
-		return false;
-	}
+	writeQueue.close();
+	reader.join();
+	writer.join();
 	
-	//compare headers
-	bytes oldHeader = dbpf::readFile(oldFile, 0, 96);
-	bytes newHeader = dbpf::readFile(newFile, 0, 96);
+	wcout << endl;
 	
-	if(bytes(oldHeader.begin(), oldHeader.begin() + 36) != bytes(newHeader.begin(), newHeader.begin() + 36)
-	|| bytes(oldHeader.begin() + 60, oldHeader.end()) != bytes(newHeader.begin() + 60, newHeader.end())) {
-		wcout << displayPath << L": New header does not match the old header" << endl;
-		return false;
-	}
+	//summary
+	dbpf::Stats& stats = dbpf::getStats();
 	
-	if(mode == dbpf::RECOMPRESS) {
-		//should only have one hole for the compressor signature
-		if(newPackage.header.holeIndexEntryCount != 1) {
-			wcout << displayPath << L": Wrong hole index count" << endl;
-			return false;
-		}
+	if(stats.skippedEntries > 0) {
+		float skipped_size = stats.skippedBytes / 1024.0;
+		wcout << L"Skipped " << stats.skippedEntries << L" incompressible entries (" << fixed << setprecision(2);
 		
-		//one hole index entry is 8 bytes long
-		if(newPackage.header.holeIndexSize != 8) {
-			wcout << displayPath << L": Wrong hole index size" << endl;
-			return false;
+		if(skipped_size >= 1000) {
+			wcout << skipped_size / 1024.0 << L" MB";
+		} else {
+			wcout << skipped_size << L" KB";
 		}
 		
-		dbpf::Hole hole = newPackage.holes[0];
+		wcout << L")" << endl;
+	}
+	
+	if(stats.unchangedEntries > 0) {
+		float unchanged_size = stats.unchangedBytes / 1024.0;
+		wcout << L"Copied " << stats.unchangedEntries << L" entries that were already compressed (" << fixed << setprecision(2);
 		
-		//compressor signature is 8 bytes long
-		if(hole.size != 8) {
-			wcout << L": Wrong hole size" << endl;
-			return false;
+		if(unchanged_size >= 1000) {
+			wcout << unchanged_size / 1024.0 << L" MB";
+		} else {
+			wcout << unchanged_size << L" KB";
 		}
 		
-		bytes holeData = dbpf::readFile(newFile, hole.location, 8);
-		uint pos = 0;
-		
-		uint sig = dbpf::getInt(holeData, pos);
-		
-		//if the file was compressed then the signature should be "BRG5"
-		if(sig != dbpf::SIGNATURE) {
-			wcout << displayPath << L": Compressor signature not found" << endl;
-			return false;
+		wcout << L")" << endl;
+	}
+	
+	if(stats.cacheHits > 0) {
+		uint lookups = stats.cacheHits + stats.cacheMisses;
+		float hit_size = stats.cacheHitBytes / 1024.0;
+		wcout << L"Compression cache: " << stats.cacheHits << L" of " << lookups << L" entries found (" << fixed << setprecision(1)
+		<< 100.0 * stats.cacheHits / lookups << L"%), " << setprecision(2);
+		
+		if(hit_size >= 1000) {
+			wcout << hit_size / 1024.0 << L" MB";
+		} else {
+			wcout << hit_size << L" KB";
 		}
 		
-		uint fileSizeInHole = dbpf::getInt(holeData, pos);
-		uint fileSize = dbpf::getFileSize(newFile);
-		
-		//file size written in the hole should match the actual file size
-		if(fileSizeInHole != fileSize) {
-			wcout << displayPath << L": File size in signature does not match the actual file size" << endl;
-			return false;
-		}
+		wcout << L" not compressed again" << endl;
 	}
 	
-	//should have the exact number of entries as the original package
-	//NOTE: getPackage does not include the directory of compressed files entry in the entries vector for both packages
-	if(oldPackage.entries.size() != newPackage.entries.size()) {
-		wcout << displayPath << L": Number of entries between old package and new package not matching" << endl;
-		return false;
+	if(!cacheName.empty() && !dbpf::getCache().save(cacheName)) {
+		wcout << L"Failed to write the compression cache " << cacheName << endl;
 	}
 	
-	//compare entries
-	for(uint i = 0; i < oldPackage.entries.size(); i++) {
-		auto& oldEntry = oldPackage.entries[i];
-		auto& newEntry = newPackage.entries[i];
-		
-		//compare TGIRs
-		if(oldEntry.type != newEntry.type || oldEntry.group != newEntry.group || oldEntry.instance != newEntry.instance || oldEntry.resource != newEntry.resource) {
-			wcout << displayPath << L": Types, groups, instances, or resources of entries not matching" << endl;
-			return false;
-		}
-		
-		//check entry content
-		bytes oldContent = dbpf::readFile(oldFile, oldEntry.location, oldEntry.size);
-		bytes newContent = dbpf::readFile(newFile, newEntry.location, newEntry.size);
-		
-		//compression info in the directory of compressed files should match the information in the compression header
-		bool compressed_in_header = newContent.size() >= 9 && newContent[4] == 0x10 && newContent[5] == 0xFB;
-		auto iter = newPackage.compressedEntries.find(dbpf::CompressedEntry{newEntry.type, newEntry.group, newEntry.instance, newEntry.resource});
-		bool in_clst = iter != newPackage.compressedEntries.end();
-		
-		if(compressed_in_header != in_clst) {
-			wcout << displayPath << L": Incorrect compression information" << endl;
-			return false;
-		}
-		
-		if(newEntry.compressed) {
-			uint tempPos = 0;
-			uint uncompressedSize = dbpf::getUncompressedSize(newContent);
-			uint compressedSize = dbpf::getInt(newContent, tempPos);
-			
-			if(uncompressedSize != iter->uncompressedSize) {
-				wcout << displayPath << L": Mismatch between the uncompressed size in the compression header and the uncompressed size in the CLST" << endl;
-				return false;
-			}
-			
-			if(compressedSize != newEntry.size) {
-				wcout << displayPath << L": Mismatch between the compressed size in the compression header and the compressed size in the index" << endl;
-				return false;
-			}
-			
-			//the compressor should only produce compressed entries that are smaller than the original decompressed entries
-			if(compressedSize > uncompressedSize) {
-				wcout << displayPath << L": Compressed size is larger than the uncompressed size for one entry" << endl;
-				return false;
-			}
-		}
-		
-		//decompress the entries and compare them
-		oldContent = dbpf::decompressEntry(oldEntry, oldContent);
-		newContent = dbpf::decompressEntry(newEntry, newContent);
-		
-		if(oldContent != newContent) {
-			wcout << displayPath << L": Mismatch between old entry and new entry" << endl;
-			return false;
+	if(listedFiles > 0) {
+		wcout << L"Skipped " << listedFiles << L" unchanged packages that are in the manifest" << endl;
+	}
+	
+	if(!manifest.save()) {
+		wcout << L"Failed to write the manifest " << manifestName << endl;
+	}
+	
+	if(stats.ringFiles > 0) {
+		wcout << L"io_uring: " << stats.ring.requests << L" requests in " << stats.ring.submits << L" submits, queue depth "
+		<< fixed << setprecision(1) << (stats.ring.submits > 0 ? (double) stats.ring.depthSum / stats.ring.submits : 0.0)
+		<< L" average, " << stats.ring.maxDepth << L" max, " << setprecision(2)
+		<< (stats.ring.seconds > 0 ? stats.ring.bytes / 1024.0 / 1024.0 / stats.ring.seconds : 0.0) << L" MB/s" << endl;
+		
+		if(stats.ringFallbacks > 0) {
+			wcout << L"io_uring failed " << stats.ringFallbacks << L" times, these reads and writes were done without it" << endl;
 		}
 	}
 	
-	//if all passes then return true
-	return true;
-}
\ No newline at end of file
+	return 0;
+}
@@ -1,11 +1,27 @@
 #ifndef DBPF_H
 #define DBPF_H
 
+#include "hash.h"
 #include "qfs.h"
+#include "uring.h"
 #include "omp.h"
 
+#ifdef _WIN32
+	#define WIN32_LEAN_AND_MEAN
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <memory>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
@@ -18,7 +34,170 @@ typedef vector<unsigned char> bytes;
 
 namespace dbpf {
 	const uint DBPF_MAGIC = 0x46504244; //"DBPF"
-	const uint SIGNATURE = 0x35475242 ; //"BRG5"
+	const uint SIGNATURE = 0x00475242; //"BRG" followed by one character for the compression level
+	const uint SIGNATURE_OPTIMAL = 0x0054504F; //"OPT" followed by one character for the compression level
+	const uint SIGNATURE_FAST = 0x00545346; //"FST" followed by one character for the compression level
+	const uint SIGNATURE_BT = 0x0054424F; //"OBT" followed by one character for the compression level
+	const uint SIGNATURE_DUAL = 0x004C5544; //"DUL" followed by one character for the compression level
+	const uint SIGNATURE_LAZY_BT = 0x0054424C; //"LBT" followed by one character for the compression level
+	const uint SIGNATURE_VERSION = 2; //version of the signature hole with the table of entries, the 8 byte signature of older versions is version 1
+	const uint FINGERPRINT_SIZE = 20; //bytes of one entry in the table of entries
+	
+	/* validation of the new package before it replaces the old package, validatePackage always checks the structure of the new package
+	VALIDATE_FUSED: each entry is decompressed by its worker right after it's compressed and compared with the content it was compressed from
+	VALIDATE_HASH: a hash of the content of each entry is kept while compressing, then the entries of the new package are read back, decompressed, and hashed in parallel
+	VALIDATE_FULL: both packages are read again, and every entry of both is decompressed and compared one at a time
+	*/
+	
+	enum Validation { VALIDATE_FUSED, VALIDATE_HASH, VALIDATE_FULL };
+	
+	/* how packages are read and written
+	IO_DEFAULT: the old package is memory mapped, the new package is written with one positioned write per entry
+	IO_URING: the reads and the writes of a window are submitted together with io_uring, when io_uring is not available this is the same as IO_DEFAULT
+	*/
+	
+	enum IOBackend { IO_DEFAULT, IO_URING };
+	
+	//compression settings
+	struct Options {
+		int level = QFS_DEFAULT_LEVEL;
+		qfs_engine engine = QFS_ENGINE_CHAIN;
+		uint splitSize = 2 * 1024 * 1024; //entries of this size or larger are split into segments which are compressed in parallel
+		uint windowSize = 64 * 1024 * 1024; //entries are compressed in windows of about this many bytes, the new content of a window is kept in memory until it's written
+		Validation validation = VALIDATE_HASH;
+		IOBackend io = IO_DEFAULT;
+		uint cacheSize = 256 * 1024 * 1024; //compressed entries are kept in the cache up to this many bytes, 0 turns the cache off
+	};
+	
+	//get the compressor signature for the compression settings, "BRG1" to "BRG9" or "BRGX" for the max level, "OPT1" to "OPTX" for the optimal engine, "FST1" to "FSTX" for the fast engine, "OBT1" to "OBTX" for the optimal binary tree engine,
+	//"DUL1" to "DULX" for the dual chain engine, and "LBT1" to "LBTX" for the lazy binary tree engine
+	uint getSignature(Options& options) {
+		uint c = options.level >= QFS_MAX_LEVEL ? 'X' : '0' + options.level;
+		
+		if(options.engine == QFS_ENGINE_OPTIMAL) {
+			return SIGNATURE_OPTIMAL + (c << 24);
+		} else if(options.engine == QFS_ENGINE_FAST) {
+			return SIGNATURE_FAST + (c << 24);
+		} else if(options.engine == QFS_ENGINE_OPTIMAL_BT) {
+			return SIGNATURE_BT + (c << 24);
+		} else if(options.engine == QFS_ENGINE_DUAL) {
+			return SIGNATURE_DUAL + (c << 24);
+		} else if(options.engine == QFS_ENGINE_BT) {
+			return SIGNATURE_LAZY_BT + (c << 24);
+		} else {
+			return SIGNATURE + (c << 24);
+		}
+	}
+	
+	//get the compression settings from a compressor signature, returns false if it's not a valid signature
+	bool getSignatureOptions(uint sig, Options& options) {
+		uint c = sig >> 24;
+		
+		if((sig & 0xFFFFFF) == SIGNATURE) {
+			options.engine = QFS_ENGINE_CHAIN;
+		} else if((sig & 0xFFFFFF) == SIGNATURE_OPTIMAL) {
+			options.engine = QFS_ENGINE_OPTIMAL;
+		} else if((sig & 0xFFFFFF) == SIGNATURE_FAST) {
+			options.engine = QFS_ENGINE_FAST;
+		} else if((sig & 0xFFFFFF) == SIGNATURE_BT) {
+			options.engine = QFS_ENGINE_OPTIMAL_BT;
+		} else if((sig & 0xFFFFFF) == SIGNATURE_DUAL) {
+			options.engine = QFS_ENGINE_DUAL;
+		} else if((sig & 0xFFFFFF) == SIGNATURE_LAZY_BT) {
+			options.engine = QFS_ENGINE_BT;
+		} else {
+			return false;
+		}
+		
+		if(c == 'X') {
+			options.level = QFS_MAX_LEVEL;
+		} else if(c >= '0' + QFS_MIN_LEVEL && c <= '9') {
+			options.level = c - '0';
+		} else {
+			return false;
+		}
+		
+		return true;
+	}
+	
+	//true if something that was compressed with the settings of signatureOptions doesn't need to be compressed again with options,
+	//unless it was compressed with a different engine or a lower level, the fast engine never improves on the other engines so it skips everything with a signature
+	bool isCompressedWith(Options& signatureOptions, Options& options) {
+		return (signatureOptions.engine == options.engine && signatureOptions.level >= options.level)
+		|| (options.engine == QFS_ENGINE_FAST && signatureOptions.engine != QFS_ENGINE_FAST);
+	}
+	
+	//file names are kept as wide strings, filesystem::path converts them on Windows, but on Linux it can only convert ASCII, so they are converted to and from UTF-8 here
+	//bytes of a file name that aren't valid UTF-8 are kept as the characters 0xDC80 to 0xDCFF, so that they are turned back into the same bytes
+	filesystem::path toPath(const wstring& name) {
+	#ifdef _WIN32
+		return filesystem::path(name);
+	#else
+		string str;
+		
+		for(wchar_t c: name) {
+			uint u = c;
+			
+			if(u < 0x80) {
+				str.push_back(u);
+			} else if(u >= 0xDC80 && u <= 0xDCFF) {
+				str.push_back(u - 0xDC00);
+			} else if(u < 0x800) {
+				str.push_back(0xC0 | u >> 6);
+				str.push_back(0x80 | (u & 0x3F));
+			} else if(u < 0x10000) {
+				str.push_back(0xE0 | u >> 12);
+				str.push_back(0x80 | (u >> 6 & 0x3F));
+				str.push_back(0x80 | (u & 0x3F));
+			} else {
+				str.push_back(0xF0 | u >> 18);
+				str.push_back(0x80 | (u >> 12 & 0x3F));
+				str.push_back(0x80 | (u >> 6 & 0x3F));
+				str.push_back(0x80 | (u & 0x3F));
+			}
+		}
+		
+		return filesystem::path(str);
+	#endif
+	}
+	
+	wstring toWString(const filesystem::path& path) {
+	#ifdef _WIN32
+		return path.wstring();
+	#else
+		const string& str = path.native();
+		wstring name;
+		uint i = 0;
+		
+		while(i < str.size()) {
+			uint c = (unsigned char) str[i];
+			uint length = c < 0x80 ? 1 : c >= 0xC2 && c < 0xE0 ? 2 : c >= 0xE0 && c < 0xF0 ? 3 : c >= 0xF0 && c < 0xF5 ? 4 : 0;
+			uint u = length == 1 ? c : c & (0x7F >> length);
+			bool valid = length != 0 && i + length <= str.size();
+			
+			for(uint j = 1; valid && j < length; j++) {
+				uint b = (unsigned char) str[i + j];
+				valid = (b & 0xC0) == 0x80;
+				u = u << 6 | (b & 0x3F);
+			}
+			
+			//overlong sequences, surrogates, and characters past the end of Unicode
+			if(valid && ((length == 3 && (u < 0x800 || (u >= 0xD800 && u < 0xE000))) || (length == 4 && (u < 0x10000 || u > 0x10FFFF)))) {
+				valid = false;
+			}
+			
+			if(valid) {
+				name.push_back(u);
+				i += length;
+			} else {
+				name.push_back(0xDC00 + c);
+				i++;
+			}
+		}
+		
+		return name;
+	#endif
+	}
 	
 	uint getFileSize(fstream& file) {
 		uint pos = file.tellg();
@@ -38,10 +217,482 @@ namespace dbpf {
 	void writeFile(fstream& file, bytes& buf) {
 		file.write(reinterpret_cast<char*>(buf.data()), buf.size());
 	}
+	
+	//print a message about a package, the packages can be processed by several threads at once so the line is printed in one go
+	void printError(wstring displayPath, wstring message) {
+		wstring line = displayPath + L": " + message;
+		
+		#pragma omp critical(output)
+		wcout << line << endl;
+	}
+	
+	//read-only range of bytes, inside of a memory mapped file or a buffer
+	struct Span {
+		const unsigned char* ptr = nullptr;
+		uint length = 0;
+		
+		Span() {}
+		Span(const unsigned char* data, uint size): ptr(data), length(size) {}
+		Span(const bytes& buf): ptr(buf.data()), length(buf.size()) {}
+		
+		const unsigned char* data() const { return ptr; }
+		uint size() const { return length; }
+		const unsigned char* begin() const { return ptr; }
+		const unsigned char* end() const { return ptr + length; }
+		unsigned char operator[](uint i) const { return ptr[i]; }
+	};
+	
+	//counters for the summary at the end of the run, shared by all threads
+	struct Stats {
+		uint skippedEntries = 0; //entries that were not compressed because they looked incompressible
+		unsigned long long skippedBytes = 0;
+		uint unchangedEntries = 0; //entries that were copied as they are because the table in the signature hole shows that they were already compressed
+		unsigned long long unchangedBytes = 0;
+		uint cacheHits = 0; //entries that were taken from the compression cache instead of being compressed
+		uint cacheMisses = 0;
+		unsigned long long cacheHitBytes = 0; //uncompressed size of the entries taken from the cache
+		uint ringFiles = 0; //files that were read or written with io_uring
+		uint ringFallbacks = 0; //batches that io_uring failed to do, they were done again with the default reads and writes
+		uring::Stats ring;
+	};
+	
+	Stats& getStats() {
+		static Stats stats;
+		return stats;
+	}
+	
+	//add what the ring of a file did to the totals when the file is closed
+	void addRingStats(uring::Ring& ring, uint fallbacks) {
+		Stats& stats = getStats();
+		
+		#pragma omp critical(stats)
+		{
+			stats.ringFiles++;
+			stats.ringFallbacks += fallbacks;
+			stats.ring.requests += ring.stats.requests;
+			stats.ring.submits += ring.stats.submits;
+			stats.ring.depthSum += ring.stats.depthSum;
+			stats.ring.maxDepth = max(stats.ring.maxDepth, ring.stats.maxDepth);
+			stats.ring.bytes += ring.stats.bytes;
+			stats.ring.seconds += ring.stats.seconds;
+		}
+	}
+	
+	//requests in flight at once on the ring of a file
+	const uint RING_DEPTH = 64;
+	
+	/*read-only access to a package file
+	the file is memory mapped if possible, then reads are pointers into the mapping that need neither a lock nor a copy,
+	with IO_URING the file is not mapped and batches of reads are submitted together to the ring of the file instead,
+	otherwise the reads fall back to seeking and reading the fstream one thread at a time*/
+	class InputFile {
+		private:
+			fstream& file;
+			const unsigned char* mapping = nullptr;
+			uint size = 0;
+			omp_lock_t lock;
+			
+			uint reads = 0;
+			unsigned long long bytesRead = 0;
+			
+			unique_ptr<uring::Ring> ring;
+			uint ringFallbacks = 0;
+			
+		#ifdef _WIN32
+			HANDLE fileHandle = INVALID_HANDLE_VALUE;
+			HANDLE mappingHandle = NULL;
+		#else
+			int fd = -1; //only open for the ring
+		#endif
+			
+			//open the file for the ring, returns false if io_uring is not available
+			bool openRing(wstring fileName) {
+			#ifdef _WIN32
+				return false;
+			#else
+				ring = make_unique<uring::Ring>(RING_DEPTH);
+				
+				if(ring->available()) {
+					fd = open(toPath(fileName).c_str(), O_RDONLY);
+				}
+				
+				if(fd == -1) {
+					ring.reset();
+					return false;
+				}
+				
+				return true;
+			#endif
+			}
+			
+			void mapFile(wstring fileName) {
+				//nothing to map, or the file is larger than the 32 bit locations in the index can reach
+				if(size == 0 || filesystem::file_size(toPath(fileName)) != size) {
+					return;
+				}
+				
+			#ifdef _WIN32
+				fileHandle = CreateFileW(fileName.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+				if(fileHandle == INVALID_HANDLE_VALUE) {
+					return;
+				}
+				
+				mappingHandle = CreateFileMappingW(fileHandle, NULL, PAGE_READONLY, 0, 0, NULL);
+				if(mappingHandle != NULL) {
+					mapping = (const unsigned char*) MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0);
+				}
+			#else
+				int fd = open(toPath(fileName).c_str(), O_RDONLY);
+				if(fd == -1) {
+					return;
+				}
+				
+				void* address = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+				::close(fd); //the mapping keeps the file open
+				
+				if(address != MAP_FAILED) {
+					mapping = (const unsigned char*) address;
+				}
+			#endif
+			}
+			
+		public:
+			//fileName is the file that is open in file
+			InputFile(fstream& file_, wstring fileName, IOBackend io = IO_DEFAULT): file(file_) {
+				omp_init_lock(&lock);
+				
+				//whatever was written to the fstream has to be in the file before it's mapped
+				file.flush();
+				size = getFileSize(file);
+				
+				try {
+					if(io != IO_URING || !openRing(fileName)) {
+						mapFile(fileName);
+					}
+				}
+				catch(filesystem::filesystem_error) {}
+			}
+			
+			InputFile(const InputFile&) = delete;
+			InputFile& operator=(const InputFile&) = delete;
+			
+			~InputFile() {
+				close();
+				omp_destroy_lock(&lock);
+			}
+			
+			//unmap the file, the file has to be unmapped before it can be replaced or deleted on Windows
+			void close() {
+			#ifdef _WIN32
+				if(mapping) {
+					UnmapViewOfFile(mapping);
+				}
+				
+				if(mappingHandle != NULL) {
+					CloseHandle(mappingHandle);
+					mappingHandle = NULL;
+				}
+				
+				if(fileHandle != INVALID_HANDLE_VALUE) {
+					CloseHandle(fileHandle);
+					fileHandle = INVALID_HANDLE_VALUE;
+				}
+			#else
+				if(mapping) {
+					munmap((void*) mapping, size);
+				}
+				
+				if(fd != -1) {
+					::close(fd);
+					fd = -1;
+				}
+			#endif
+				
+				mapping = nullptr;
+				
+				if(ring) {
+					addRingStats(*ring, ringFallbacks);
+					ring.reset();
+				}
+			}
+			
+			bool isMapped() {
+				return mapping != nullptr;
+			}
+			
+			uint getSize() {
+				return size;
+			}
+			
+			//number of reads from the file and the bytes they read, prefetches count as reads when the file is mapped
+			uint getReads() {
+				return reads;
+			}
+			
+			unsigned long long getBytesRead() {
+				return bytesRead;
+			}
+			
+			//get size bytes at pos, buffer is only used when the file is not mapped
+			//the caller checks that the range is inside of the file
+			Span read(uint pos, uint size, bytes& buffer) {
+				if(mapping) {
+					return Span(mapping + pos, size);
+				}
+				
+				omp_set_lock(&lock);
+				buffer = readFile(file, pos, size);
+				reads++;
+				bytesRead += size;
+				omp_unset_lock(&lock);
+				
+				return Span(buffer);
+			}
+			
+			//get several ranges of (pos, size) at once, buffers are only used when the file is not mapped
+			//with the ring all of the reads are submitted together, if that fails they are read one at a time
+			vector<Span> read(vector<pair<uint, uint>>& ranges, vector<bytes>& buffers) {
+				vector<Span> spans = vector<Span>(ranges.size());
+				buffers = vector<bytes>(ranges.size());
+				
+			#ifndef _WIN32
+				if(ring) {
+					vector<uring::Request> requests;
+					unsigned long long total = 0;
+					
+					for(int i = 0; i < ranges.size(); i++) {
+						buffers[i] = bytes(ranges[i].second);
+						requests.push_back(uring::Request{uring::READ, ranges[i].first, buffers[i].data(), ranges[i].second});
+						total += ranges[i].second;
+					}
+					
+					omp_set_lock(&lock);
+					bool success = ring->run(fd, requests);
+					
+					if(success) {
+						reads += requests.size();
+						bytesRead += total;
+					} else {
+						ringFallbacks++;
+					}
+					
+					omp_unset_lock(&lock);
+					
+					if(success) {
+						for(int i = 0; i < ranges.size(); i++) {
+							spans[i] = Span(buffers[i]);
+						}
+						
+						return spans;
+					}
+				}
+			#endif
+				
+				for(int i = 0; i < ranges.size(); i++) {
+					spans[i] = read(ranges[i].first, ranges[i].second, buffers[i]);
+				}
+				
+				return spans;
+			}
+			
+			//ask the system to start reading a range of the mapping, so that it's read in one go instead of one page fault at a time
+			void prefetch(uint pos, uint size) {
+				if(!mapping || size == 0) {
+					return;
+				}
+				
+			#ifdef _WIN32
+				WIN32_MEMORY_RANGE_ENTRY range = {(void*) (mapping + pos), size};
+				PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+			#else
+				//madvise needs an address on a page boundary
+				uint offset = pos % sysconf(_SC_PAGESIZE);
+				madvise((void*) (mapping + pos - offset), size + offset, MADV_WILLNEED);
+			#endif
+				
+				omp_set_lock(&lock);
+				reads++;
+				bytesRead += size;
+				omp_unset_lock(&lock);
+			}
+	};
+
+	/*write access to a package file at any position
+	writes go to the file with pwrite or WriteFile with an offset, so threads writing to different parts of the file don't wait for each other,
+	with IO_URING batches of writes are submitted together to the ring of the file instead,
+	otherwise the writes fall back to seeking and writing the fstream one thread at a time
+	a write that fails or only writes part of its bytes, like when the disk is full, marks the file as failed, then the file must not replace the old package*/
+	class OutputFile {
+		private:
+			fstream& file;
+			omp_lock_t lock;
+			bool failed = false;
+			
+			unique_ptr<uring::Ring> ring;
+			uint ringFallbacks = 0;
+			
+		#ifdef _WIN32
+			HANDLE fileHandle = INVALID_HANDLE_VALUE;
+		#else
+			int fd = -1;
+		#endif
+			
+		public:
+			//fileName is the file that is open in file
+			OutputFile(fstream& file_, wstring fileName, IOBackend io = IO_DEFAULT): file(file_) {
+				omp_init_lock(&lock);
+				
+				//whatever was written to the fstream has to be in the file before it's written to with another handle
+				file.flush();
+				
+			#ifdef _WIN32
+				fileHandle = CreateFileW(fileName.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+			#else
+				try { fd = open(toPath(fileName).c_str(), O_WRONLY); }
+				catch(filesystem::filesystem_error) {}
+				
+				if(io == IO_URING && fd != -1) {
+					ring = make_unique<uring::Ring>(RING_DEPTH);
+					
+					if(!ring->available()) {
+						ring.reset();
+					}
+				}
+			#endif
+			}
+			
+			OutputFile(const OutputFile&) = delete;
+			OutputFile& operator=(const OutputFile&) = delete;
+			
+			~OutputFile() {
+				close();
+				omp_destroy_lock(&lock);
+			}
+			
+			//close the handle, the file has to be closed before it can be replaced or deleted on Windows
+			void close() {
+			#ifdef _WIN32
+				if(fileHandle != INVALID_HANDLE_VALUE) {
+					CloseHandle(fileHandle);
+					fileHandle = INVALID_HANDLE_VALUE;
+				}
+			#else
+				//errors of earlier writes can show up when the file is closed
+				if(fd != -1 && ::close(fd) != 0) {
+					failed = true;
+				}
+				
+				fd = -1;
+			#endif
+				
+				if(ring) {
+					addRingStats(*ring, ringFallbacks);
+					ring.reset();
+				}
+			}
+			
+			//false if any write failed
+			bool good() {
+				return !failed;
+			}
+			
+			//write buf at pos, returns false if not all of it was written
+			bool write(uint pos, bytes& buf) {
+				uint written = 0;
+				bool success;
+				
+			#ifdef _WIN32
+				if(fileHandle != INVALID_HANDLE_VALUE) {
+					while(written < buf.size()) {
+						OVERLAPPED overlapped = {};
+						overlapped.Offset = pos + written;
+						DWORD n = 0;
+						
+						if(!WriteFile(fileHandle, buf.data() + written, buf.size() - written, &n, &overlapped) || n == 0) {
+							break;
+						}
+						
+						written += n;
+					}
+					
+					success = written == buf.size();
+				} else
+			#else
+				if(fd != -1) {
+					while(written < buf.size()) {
+						ssize_t n = pwrite(fd, buf.data() + written, buf.size() - written, (off_t) pos + written);
+						
+						if(n <= 0) {
+							break;
+						}
+						
+						written += n;
+					}
+					
+					success = written == buf.size();
+				} else
+			#endif
+				{
+					omp_set_lock(&lock);
+					file.seekp(pos, ios::beg);
+					writeFile(file, buf);
+					success = !file.fail();
+					omp_unset_lock(&lock);
+				}
+				
+				if(!success) {
+					#pragma omp critical(outputFile)
+					failed = true;
+				}
+				
+				return success;
+			}
+			
+			//write each of bufs at the position with the same index, returns false if any of them was not written completely
+			//with the ring all of the writes are submitted together, otherwise, or if that fails, they are written in parallel
+			bool write(vector<uint>& positions, vector<bytes*>& bufs) {
+			#ifndef _WIN32
+				if(ring) {
+					vector<uring::Request> requests;
+					
+					for(int i = 0; i < bufs.size(); i++) {
+						requests.push_back(uring::Request{uring::WRITE, positions[i], bufs[i]->data(), (uint) bufs[i]->size()});
+					}
+					
+					omp_set_lock(&lock);
+					bool success = ring->run(fd, requests);
+					
+					if(!success) {
+						ringFallbacks++;
+					}
+					
+					omp_unset_lock(&lock);
+					
+					if(success) {
+						return true;
+					}
+				}
+			#endif
+				
+				uint failures = 0;
+				
+				#pragma omp parallel for
+				for(int i = 0; i < bufs.size(); i++) {
+					if(!write(positions[i], *bufs[i])) {
+						#pragma omp atomic
+						failures++;
+					}
+				}
+				
+				return failures == 0;
+			}
+	};
 
 	//convert 4 bytes from buf at pos to an integer and increment pos (little endian)
-	uint getInt(bytes& buf, uint& pos) {
-		return ((uint) buf[pos++]) + ((uint) buf[pos++] << 8) + ((uint) buf[pos++] << 16) + ((uint) buf[pos++] << 24);
+	uint getInt(Span buf, uint& pos) {
+		uint n = ((uint) buf[pos]) + ((uint) buf[pos + 1] << 8) + ((uint) buf[pos + 2] << 16) + ((uint) buf[pos + 3] << 24);
+		pos += 4;
+		return n;
 	}
 
 	//put integer in buf at pos and increment pos (little endian)
@@ -53,7 +704,7 @@ namespace dbpf {
 	}
 
 	//get the uncompressed size from the compression header (3 bytes big endian integer)
-	uint getUncompressedSize(bytes& buf) {
+	uint getUncompressedSize(Span buf) {
 		return ((uint) buf[6] << 16) + ((uint) buf[7] << 8) + ((uint) buf[8]);
 	}
 	
@@ -96,6 +747,9 @@ namespace dbpf {
 		uint uncompressedSize = 0;
 		bool compressed = false;
 		bool repeated = false; //appears twice in same package
+		unsigned long long hash = 0; //hash of the uncompressed content, only kept by putPackage for VALIDATE_HASH
+		unsigned long long fingerprint = 0; //hash of the entry as it's stored in the package, for the table in the signature hole
+		uint fingerprintSignature = 0; //compressor signature of the settings that the entry was stored with, 0 if the entry is not in the table
 	};
 	
 	//representing a hole in the package file
@@ -113,6 +767,13 @@ namespace dbpf {
 		uint uncompressedSize;
 	};
 
+	//for holding info from the table of entries in the signature hole
+	struct Fingerprint {
+		unsigned long long hash;
+		uint signature;
+		uint uncompressedSize; //0 if the entry was stored uncompressed
+	};
+
 	//for use by sets and maps
 	struct hashFunction {
 		template<class EntryType>
@@ -128,32 +789,440 @@ namespace dbpf {
 		}
 	};
 	
+	//the table of entries only keeps a 32 bit hash of the TGIR of each entry, when two entries have the same hash the hash of the content tells them apart
+	uint getFingerprintKey(Entry& entry) {
+		uint tgir[] = {entry.type, entry.group, entry.instance, entry.resource};
+		unsigned char data[16];
+		
+		//little endian, like everything else in the package
+		for(int i = 0; i < 16; i++) {
+			data[i] = tgir[i / 4] >> (i % 4 * 8);
+		}
+		
+		return (uint) xxh::hash64(data, 16);
+	}
+	
 	//representing one package file
 	struct Package {
 		bool unpacked = true;
 		bool signature_in_package = false;
+		Options signature_options; //compression settings in the signature
 		Header header;
 		vector<Entry> entries;
 		vector<Hole> holes;
 		unordered_set<CompressedEntry, hashFunction, equalFunction> compressedEntries; //directory of compressed files
 	};
 	
-	bytes compressEntry(Entry& entry, bytes& content) {
-		if(!entry.compressed && !entry.repeated) {
+	//compressor context of the current thread, kept for the whole run so that the compression tables are only allocated once per thread
+	qfs_context& getContext() {
+		static thread_local qfs_context context;
+		return context;
+	}
+	
+	//entries that are this close to each other in the file are read with one read, the bytes between them are read and thrown away
+	const uint READ_GAP = 64 * 1024;
+	
+	//reads of entries that are next to each other stop growing at this size, a larger entry is read alone
+	const uint MAX_READ_SIZE = 16 * 1024 * 1024;
+	
+	//one read of the planned reads and the entries in it
+	struct PlannedRead {
+		uint location;
+		uint size;
+		vector<int> entries;
+	};
+	
+	/*read the content of entries[start] to entries[end - 1]
+	the index is often not in the same order as the entries in the file, so the reads are sorted by location
+	and entries that are next to each other or close are merged into one large read, which avoids seeking back and forth in the file
+	returns the content of each entry in index order, the spans point into buffers or into the mapping of the file*/
+	vector<Span> readEntries(InputFile& file, vector<Entry>& entries, int start, int end, vector<bytes>& buffers) {
+		vector<int> order;
+		
+		for(int i = start; i < end; i++) {
+			order.push_back(i);
+		}
+		
+		sort(order.begin(), order.end(), [&](int a, int b) {
+			return entries[a].location < entries[b].location;
+		});
+		
+		vector<PlannedRead> plan;
+		
+		for(int i: order) {
+			auto& entry = entries[i];
+			
+			if(!plan.empty()) {
+				PlannedRead& last = plan.back();
+				uint lastEnd = last.location + last.size;
+				uint entryEnd = entry.location + entry.size;
+				
+				//entries can overlap or repeat, the read only has to grow when the entry goes past its end
+				if(entry.location <= lastEnd + READ_GAP && max(entryEnd, lastEnd) - last.location <= MAX_READ_SIZE) {
+					last.size = max(entryEnd, lastEnd) - last.location;
+					last.entries.push_back(i);
+					continue;
+				}
+			}
+			
+			plan.push_back(PlannedRead{entry.location, entry.size, vector<int>{i}});
+		}
+		
+		for(auto& read: plan) {
+			file.prefetch(read.location, read.size);
+		}
+		
+		vector<pair<uint, uint>> ranges;
+		
+		for(auto& read: plan) {
+			ranges.push_back(make_pair(read.location, read.size));
+		}
+		
+		vector<Span> data = file.read(ranges, buffers);
+		vector<Span> contents = vector<Span>(end - start);
+		
+		for(int i = 0; i < plan.size(); i++) {
+			for(int j: plan[i].entries) {
+				contents[j - start] = Span(data[i].data() + entries[j].location - plan[i].location, entries[j].size);
+			}
+		}
+		
+		return contents;
+	}
+	
+	//entries are processed in windows of about options.windowSize bytes of content, returns the end of the window that starts at start
+	int getWindowEnd(vector<Entry>& entries, int start, Options& options) {
+		unsigned long long windowSize = 0;
+		int end = start;
+		
+		while(end < entries.size() && (end == start || windowSize < options.windowSize)) {
+			windowSize += entries[end].compressed ? entries[end].uncompressedSize : entries[end].size;
+			end++;
+		}
+		
+		return end;
+	}
+	
+	//key of an entry in the compression cache, the XXH64 and the size of the uncompressed content and everything that changes what the compressor makes of it
+	struct CacheKey {
+		unsigned long long hash;
+		uint size;
+		uint signature; //engine and level, the same as the compressor signature
+		uint split; //1 if the entry is compressed in segments
+		
+		bool operator==(const CacheKey& other) const {
+			return hash == other.hash && size == other.size && signature == other.signature && split == other.split;
+		}
+	};
+	
+	struct CacheKeyHash {
+		size_t operator()(const CacheKey& key) const {
+			return key.hash ^ key.signature ^ key.split;
+		}
+	};
+	
+	const uint CACHE_MAGIC = 0x43534651; //"QFSC"
+	
+	//has to change whenever the compressor makes different output with the same settings, the cache file of an older version is ignored
+	const uint CACHE_VERSION = 2;
+	
+	/*compressed entries by the hash of their content
+	Sims 2 packages are full of resources that are copied from other packages, like the meshes and the textures of recolors,
+	so the compressed entry is kept and the next copy of the same content, in this package, another package, or a later run, doesn't have to be compressed again
+	an entry that didn't get smaller is cached as an empty entry, so that it isn't tried again
+	
+	the key is a XXH64 of the content, which is many times faster than the compressors, but two different entries can have the same hash,
+	so an entry from the cache is decompressed and compared with the content before it's used, an entry that doesn't match is compressed as usual
+	
+	the cache can be saved to a file and loaded on the next run, the file is:
+		DWORD magic "QFSC"
+		DWORD version
+		then for each entry: QWORD XXH64, DWORD size of the content, DWORD signature, DWORD split, DWORD size, the compressed entry
+	*/
+	class CompressionCache {
+		private:
+			struct CachedEntry {
+				bytes content;
+				bool used; //found or added in this run
+			};
+			
+			unordered_map<CacheKey, CachedEntry, CacheKeyHash> entries;
+			vector<CacheKey> unused; //entries loaded from the file, they are removed first when the cache is full
+			unsigned long long size = 0;
+			omp_lock_t lock;
+			
+			static unsigned long long getEntrySize(const bytes& content) {
+				return sizeof(CacheKey) + sizeof(CachedEntry) + content.size();
+			}
+			
+			//remove entries that were not used in this run until there is room for newSize more bytes, returns false if there is not enough room
+			bool makeRoom(unsigned long long newSize, unsigned long long maxSize) {
+				while(size + newSize > maxSize && !unused.empty()) {
+					auto it = entries.find(unused.back());
+					unused.pop_back();
+					
+					if(it != entries.end() && !it->second.used) {
+						size -= getEntrySize(it->second.content);
+						entries.erase(it);
+					}
+				}
+				
+				return size + newSize <= maxSize;
+			}
+			
+		public:
+			CompressionCache() {
+				omp_init_lock(&lock);
+			}
+			
+			CompressionCache(const CompressionCache&) = delete;
+			CompressionCache& operator=(const CompressionCache&) = delete;
+			
+			~CompressionCache() {
+				omp_destroy_lock(&lock);
+			}
+			
+			//returns true and the compressed entry if the key is in the cache, content is empty if the entry doesn't get smaller
+			bool find(const CacheKey& key, bytes& content) {
+				omp_set_lock(&lock);
+				auto it = entries.find(key);
+				bool found = it != entries.end();
+				
+				if(found) {
+					it->second.used = true;
+					content = it->second.content;
+				}
+				
+				omp_unset_lock(&lock);
+				return found;
+			}
+			
+			//the entry is not added if the cache is full of entries that were used in this run
+			void add(const CacheKey& key, const bytes& content, unsigned long long maxSize) {
+				omp_set_lock(&lock);
+				
+				if(entries.find(key) == entries.end() && makeRoom(getEntrySize(content), maxSize)) {
+					entries[key] = CachedEntry{content, true};
+					size += getEntrySize(content);
+				}
+				
+				omp_unset_lock(&lock);
+			}
+			
+			//load the entries of a cache file up to maxSize bytes, a missing file or a file of an older version is an empty cache
+			//returns false if the file is damaged, the entries before the damage are still loaded
+			bool load(wstring fileName, unsigned long long maxSize) {
+				fstream file = fstream(toPath(fileName), ios::in | ios::binary);
+				
+				if(!file.is_open()) {
+					return true;
+				}
+				
+				uint fileSize = getFileSize(file);
+				
+				if(fileSize < 8) {
+					return fileSize == 0;
+				}
+				
+				bytes buf = readFile(file, 0, fileSize);
+				uint pos = 0;
+				
+				if(getInt(buf, pos) != CACHE_MAGIC) {
+					return false;
+				}
+				
+				if(getInt(buf, pos) != CACHE_VERSION) {
+					return true;
+				}
+				
+				omp_set_lock(&lock);
+				
+				while(pos < fileSize) {
+					if(fileSize - pos < 24) {
+						break;
+					}
+					
+					CacheKey key;
+					key.hash = getInt(buf, pos);
+					key.hash += (unsigned long long) getInt(buf, pos) << 32;
+					key.size = getInt(buf, pos);
+					key.signature = getInt(buf, pos);
+					key.split = getInt(buf, pos);
+					uint length = getInt(buf, pos);
+					
+					if(length > fileSize - pos) {
+						break;
+					}
+					
+					bytes content = bytes(buf.begin() + pos, buf.begin() + pos + length);
+					pos += length;
+					
+					if(size + getEntrySize(content) > maxSize) {
+						pos = fileSize; //the rest doesn't fit, it was used least recently anyway
+						break;
+					}
+					
+					if(entries.find(key) == entries.end()) {
+						size += getEntrySize(content);
+						entries[key] = CachedEntry{move(content), false};
+						unused.push_back(key);
+					}
+				}
+				
+				//removed from the back, so the entries at the end of the file go first
+				reverse(unused.begin(), unused.end());
+				omp_unset_lock(&lock);
+				
+				return pos == fileSize;
+			}
+			
+			//save all of the entries, the ones that were used in this run first so that they are the last ones to go when the cache is full
+			//the file is written next to fileName and then replaces it, returns false if it couldn't be written
+			bool save(wstring fileName) {
+				wstring tempFileName = fileName + L".new";
+				fstream file = fstream(toPath(tempFileName), ios::out | ios::binary | ios::trunc);
+				
+				if(!file.is_open()) {
+					return false;
+				}
+				
+				bytes header = bytes(8);
+				uint pos = 0;
+				putInt(header, pos, CACHE_MAGIC);
+				putInt(header, pos, CACHE_VERSION);
+				writeFile(file, header);
+				
+				for(int used = 1; used >= 0; used--) {
+					for(auto& [key, cached]: entries) {
+						if(cached.used != (bool) used) {
+							continue;
+						}
+						
+						bytes record = bytes(24);
+						pos = 0;
+						putInt(record, pos, key.hash);
+						putInt(record, pos, key.hash >> 32);
+						putInt(record, pos, key.size);
+						putInt(record, pos, key.signature);
+						putInt(record, pos, key.split);
+						putInt(record, pos, cached.content.size());
+						
+						writeFile(file, record);
+						file.write(reinterpret_cast<const char*>(cached.content.data()), cached.content.size());
+					}
+				}
+				
+				file.close();
+				
+				if(file.fail()) {
+					filesystem::remove(toPath(tempFileName));
+					return false;
+				}
+				
+				try {
+					filesystem::rename(toPath(tempFileName), toPath(fileName));
+				}
+				
+				catch(filesystem::filesystem_error) {
+					return false;
+				}
+				
+				return true;
+			}
+	};
+	
+	CompressionCache& getCache() {
+		static CompressionCache cache;
+		return cache;
+	}
+	
+	//decompress a newly compressed entry and compare it with the content it was compressed from
+	bool verifyEntry(Span compressedContent, Span content) {
+		if(getUncompressedSize(compressedContent) != content.size()) {
+			return false;
+		}
+		
+		bytes buffer = bytes(content.size());
+		return qfs_decompress(compressedContent.data(), compressedContent.size(), buffer.data(), buffer.size(), false) && equal(buffer.begin(), buffer.end(), content.begin());
+	}
+	
+	bytes compressEntry(Entry& entry, Span content, Options& options, qfs_context& context) {
+		//entries smaller than the compression header can't get smaller
+		if(!entry.compressed && !entry.repeated && content.size() > 9) {
+			//skip entries that are already compressed in some other format, like images
+			if(!qfs_is_compressible(content.data(), content.size())) {
+				Stats& stats = getStats();
+				
+				#pragma omp atomic
+				stats.skippedEntries++;
+				
+				#pragma omp atomic
+				stats.skippedBytes += content.size();
+				
+				return bytes(content.begin(), content.end());
+			}
+			
+			bool split = content.size() >= options.splitSize;
+			CompressionCache& cache = getCache();
+			CacheKey key;
+			
+			//the compressor always makes the same entry from the same content with the same settings, so a copy of an entry that was already compressed is taken from the cache
+			if(options.cacheSize > 0) {
+				Stats& stats = getStats();
+				key = CacheKey{xxh::hash64(content.data(), content.size()), content.size(), getSignature(options), split};
+				bytes cachedContent;
+				
+				if(cache.find(key, cachedContent) && (cachedContent.empty() || verifyEntry(cachedContent, content))) {
+					#pragma omp atomic
+					stats.cacheHits++;
+					
+					#pragma omp atomic
+					stats.cacheHitBytes += content.size();
+					
+					if(cachedContent.empty()) {
+						return bytes(content.begin(), content.end());
+					}
+					
+					entry.compressed = true;
+					return cachedContent;
+				}
+				
+				#pragma omp atomic
+				stats.cacheMisses++;
+			}
+			
 			bytes newContent = bytes(content.size() - 1); //must be smaller than the original, otherwise there is no benefit
-			int length = qfs_compress(content.data(), content.size(), newContent.data());
+			int length;
+			
+			//large entries are split into segments that are compressed by all threads,
+			//they are split even if the threads are already busy with other entries, then the segments are compressed one after another by this thread,
+			//so that the new entry is the same no matter how many threads there are
+			if(split) {
+				length = qfs_compress_parallel(content.data(), content.size(), newContent.data(), options.level, options.engine, QFS_SEGMENT_SIZE);
+			} else {
+				length = qfs_compress(context, content.data(), content.size(), newContent.data(), options.level, options.engine);
+			}
 			
 			if(length > 0) {
 				newContent.resize(length);
 				entry.compressed = true;
+			} else {
+				newContent.clear();
+			}
+			
+			if(options.cacheSize > 0) {
+				cache.add(key, newContent, options.cacheSize);
+			}
+			
+			if(entry.compressed) {
 				return newContent;
 			}
 		}
 		
-		return content;
+		return bytes(content.begin(), content.end());
 	}
 
-	bytes decompressEntry(Entry& entry, bytes& content) {
+	bytes decompressEntry(Entry& entry, Span content) {
 		if(entry.compressed) {
 			bytes newContent = bytes(getUncompressedSize(content));
 			bool success = qfs_decompress(content.data(), content.size(), newContent.data(), newContent.size(), false);
@@ -162,68 +1231,128 @@ namespace dbpf {
 				entry.compressed = false;
 				return newContent;
 			} else {
+				#pragma omp critical(output)
 				wcout << L"Failed to decompress entry" << endl;
 			}
 		}
 		
-		return content;
+		return bytes(content.begin(), content.end());
 	}
 	
-	bytes recompressEntry(Entry& entry, bytes& content) {
+	//verified is set to false if the new entry doesn't decompress back to the old entry, this is only checked for VALIDATE_FUSED
+	bytes recompressEntry(Entry& entry, Span content, Options& options, qfs_context& context, bool& verified) {
 		bool wasCompressed = entry.compressed;
 		
-		bytes newContent = decompressEntry(entry, content);
-		newContent = compressEntry(entry, newContent);
+		bytes uncompressedContent = decompressEntry(entry, content);
+		
+		if(options.validation == VALIDATE_HASH) {
+			entry.hash = xxh::hash64(uncompressedContent.data(), uncompressedContent.size());
+		}
+		
+		bytes newContent = compressEntry(entry, uncompressedContent, options, context);
 		
 		//only return the new entry if there is a reduction in size
 		if(newContent.size() < content.size()) {
+			//the uncompressed content is still in the cache, so this is much cheaper than reading and decompressing the entry again in validatePackage
+			if(options.validation == VALIDATE_FUSED && entry.compressed) {
+				verified = verifyEntry(newContent, uncompressedContent);
+			}
+			
 			return newContent;
 		} else {
 			entry.compressed = wasCompressed;
-			return content;
+			return bytes(content.begin(), content.end());
 		}
 	}
 	
+	//read only the header and the holes of a package to look for the compressor signature, so that a package that was already compressed can be skipped without reading its index
+	//returns false if there is no signature or the package can't be read, getPackage reports the errors
+	bool probeSignature(InputFile& file, Options& signatureOptions) {
+		uint fileSize = file.getSize();
+		
+		if(fileSize < 96) {
+			return false;
+		}
+		
+		bytes buffer;
+		Span data = file.read(0, 96, buffer);
+		uint pos = 0;
+		
+		if(getInt(data, pos) != DBPF_MAGIC) {
+			return false;
+		}
+		
+		//hole index entry count, location, and size
+		pos = 48;
+		uint holeIndexEntryCount = getInt(data, pos);
+		uint holeIndexLocation = getInt(data, pos);
+		uint holeIndexSize = getInt(data, pos);
+		
+		//the signature is the only hole
+		if(holeIndexEntryCount != 1 || holeIndexSize != 8 || holeIndexLocation > fileSize || holeIndexLocation + 8 > fileSize) {
+			return false;
+		}
+		
+		data = file.read(holeIndexLocation, 8, buffer);
+		pos = 0;
+		
+		uint location = getInt(data, pos);
+		uint size = getInt(data, pos);
+		
+		//the table of entries after the signature is not needed here
+		if(size < 8 || location > fileSize || location + 8 > fileSize) {
+			return false;
+		}
+		
+		data = file.read(location, 8, buffer);
+		pos = 0;
+		
+		uint sig = getInt(data, pos);
+		uint fileSizeInHole = getInt(data, pos);
+		
+		return getSignatureOptions(sig, signatureOptions) && fileSizeInHole == fileSize;
+	}
+	
 	//get package infromation from file
-	Package getPackage(fstream& file, wstring displayPath, Mode mode) {
-		file.seekg(0);
-		uint fileSize = getFileSize(file);
+	Package getPackage(InputFile& file, wstring displayPath, Mode mode) {
+		uint fileSize = file.getSize();
 		
 		if(fileSize < 96) {
-			wcout << displayPath << L": Header not found" << endl;
+			printError(displayPath, L"Header not found");
 			return Package{false};
 		}
 		
 		Package package = Package();
 		
 		//header
-		bytes buffer = readFile(file, 0, 96);
+		bytes buffer;
+		Span data = file.read(0, 96, buffer);
 		uint pos = 0;
 		
 		//package file magic header "DBPF" should be the first 4 bytes of any dbpf package file
-		uint magic = getInt(buffer, pos);
+		uint magic = getInt(data, pos);
 		
 		if(magic != DBPF_MAGIC) {
-			wcout << displayPath << L": Magic header not found" << endl;
+			printError(displayPath, L"Magic header not found");
 			return Package{false};
 		}
 		
-		package.header.majorVersion = getInt(buffer, pos);
-		package.header.minorVersion = getInt(buffer, pos);
-		package.header.majorUserVersion = getInt(buffer, pos);
-		package.header.minorUserVersion = getInt(buffer, pos);
-		package.header.flags = getInt(buffer, pos);
-		package.header.createdDate = getInt(buffer, pos);
-		package.header.modifiedDate = getInt(buffer, pos);
-		package.header.indexMajorVersion = getInt(buffer, pos);
-		package.header.indexEntryCount = getInt(buffer, pos);
-		package.header.indexLocation = getInt(buffer, pos);
-		package.header.indexSize = getInt(buffer, pos);
-		package.header.holeIndexEntryCount = getInt(buffer, pos);
-		package.header.holeIndexLocation = getInt(buffer, pos);
-		package.header.holeIndexSize = getInt(buffer, pos);
-		package.header.indexMinorVersion = getInt(buffer, pos);
-		package.header.remainder = bytes(buffer.begin() + 64, buffer.end());
+		package.header.majorVersion = getInt(data, pos);
+		package.header.minorVersion = getInt(data, pos);
+		package.header.majorUserVersion = getInt(data, pos);
+		package.header.minorUserVersion = getInt(data, pos);
+		package.header.flags = getInt(data, pos);
+		package.header.createdDate = getInt(data, pos);
+		package.header.modifiedDate = getInt(data, pos);
+		package.header.indexMajorVersion = getInt(data, pos);
+		package.header.indexEntryCount = getInt(data, pos);
+		package.header.indexLocation = getInt(data, pos);
+		package.header.indexSize = getInt(data, pos);
+		package.header.holeIndexEntryCount = getInt(data, pos);
+		package.header.holeIndexLocation = getInt(data, pos);
+		package.header.holeIndexSize = getInt(data, pos);
+		package.header.indexMinorVersion = getInt(data, pos);
+		package.header.remainder = bytes(data.begin() + 64, data.end());
 		
 		/*valid Sims 2 package file header information is:
 			major version = 1
@@ -233,18 +1362,18 @@ namespace dbpf {
 		if different values are encountered, then the package is likely a package file for another game*/
 		
 		if(package.header.majorVersion != 1 || (package.header.minorVersion != 0 && package.header.minorVersion != 1 && package.header.minorVersion != 2) || package.header.indexMajorVersion != 7) {
-			wcout << displayPath << L": Not a Sims 2 package file" << endl;
+			printError(displayPath, L"Not a Sims 2 package file");
 			return Package{false};
 		}
 		
 		if(package.header.indexMinorVersion > 2) {
-			wcout << displayPath << L": Unrecognized index version" << endl;
+			printError(displayPath, L"Unrecognized index version");
 			return Package{false};
 		}
 		
 		//boundary checks
 		if(package.header.indexLocation > fileSize || package.header.indexLocation + package.header.indexSize > fileSize) {
-			wcout << displayPath << L": Entry index outside of bounds" << endl;
+			printError(displayPath, L"Entry index outside of bounds");
 			return Package{false};
 		}
 		
@@ -258,31 +1387,31 @@ namespace dbpf {
 		}
 		
 		if(indexEntryCountToIndexSize > package.header.indexSize) {
-			wcout << displayPath << L": Entry count larger than index size" << endl;
+			printError(displayPath, L"Entry count larger than index size");
 			return Package{false};
 		}
 		
 		//boundary checks
 		if(package.header.holeIndexLocation > fileSize || package.header.holeIndexLocation + package.header.holeIndexSize > fileSize) {
-			wcout << displayPath << L": Hole index outside of bounds" << endl;
+			printError(displayPath, L"Hole index outside of bounds");
 			return Package{false};
 		}
 		
 		//check if the hole index entry count and the hole index size match up
 		if(package.header.holeIndexEntryCount * 8 != package.header.holeIndexSize) {
-			wcout << displayPath << L": Hole count larger than hole index size" << endl;
+			printError(displayPath, L"Hole count larger than hole index size");
 			return Package{false};
 		}
 		
 		//holes
-		buffer = readFile(file, package.header.holeIndexLocation, package.header.holeIndexSize);
+		data = file.read(package.header.holeIndexLocation, package.header.holeIndexSize, buffer);
 		pos = 0;
 		
 		package.holes.reserve(package.header.holeIndexEntryCount);
 		
 		for(uint i = 0; i < package.header.holeIndexEntryCount; i++) {
-			uint location = getInt(buffer, pos);
-			uint size = getInt(buffer, pos);
+			uint location = getInt(data, pos);
+			uint size = getInt(data, pos);
 			package.holes.push_back(Hole{location, size});
 		}
 		
@@ -295,62 +1424,109 @@ namespace dbpf {
 		however here we are exploiting them to store some data
 		
 		signature format is:
-			DWORD signature = "BRG5"
+			DWORD signature = "BRG" + level, "OPT" + level, "FST" + level, "OBT" + level, "DUL" + level, or "LBT" + level
 			DWORD file size
+		version 1, written by older versions of this compressor, ends here, the hole is 8 bytes long and older versions don't accept any other size
+		version 2 is followed by a table of the entries:
+			DWORD version = 2
+			DWORD entry count
+			then for each entry:
+				DWORD hash of the type, group, instance, and resource
+				QWORD XXH64 of the entry as it's stored in the package
+				DWORD signature of the settings that the entry was compressed with
+				DWORD uncompressed size, 0 if the entry is stored uncompressed
 			
-		"BRG5" refers to the compression algorithm used by this compressor, which is an implementation of EA's Refpack/QFS compression algorithm written by Ben Rudiak-Gould adjusted to use zlib's level 5 compression parameters
+		"BRG" refers to the compression algorithm used by this compressor, which is an implementation of EA's Refpack/QFS compression algorithm written by Ben Rudiak-Gould adjusted to use zlib's compression parameters
+		"OPT" refers to the same algorithm with optimal parsing
+		"FST" refers to the fast greedy encoder
+		"OBT" refers to optimal parsing with a binary tree match finder
+		"DUL" refers to lazy matching with separate near and far hash chains
+		"LBT" refers to lazy matching with a binary tree match finder
+		the last character is the compression level that was used, "1" to "9" or "X" for the max level, older versions of this compressor always used level 5
 			
-		if the signature is found and the file size has not changed then we can skip the file
+		if the signature is found and the file size has not changed then we can skip the file, unless a different engine or a higher compression level is requested
+		if the file has changed since, for example because a resource was added to it, then the entries that still have the same hash as in the table are copied as they are,
+		and only the new and the changed entries are compressed
+		the table is only read in that case, an unchanged package is either skipped or all of its entries are compressed again
 		*/
 		
-		if(package.header.holeIndexEntryCount == 1 && package.holes[0].size == 8) {
+		unordered_map<uint, Fingerprint> fingerprints;
+		
+		if(package.header.holeIndexEntryCount == 1 && package.holes[0].size >= 8) {
 			Hole hole = package.holes[0];
 			
 			//boundary checks
 			if(hole.location > fileSize || hole.location + hole.size > fileSize) {
-				wcout << displayPath << L": Hole location outside of bounds" << endl;
+				printError(displayPath, L"Hole location outside of bounds");
 				return Package{false}; 
 			}
 			
-			buffer = readFile(file, hole.location, 8);
+			data = file.read(hole.location, hole.size >= 16 ? 16 : 8, buffer);
 			pos = 0;
 			
-			uint sig = getInt(buffer, pos);
-			uint fileSizeInHole = getInt(buffer, pos);
+			uint sig = getInt(data, pos);
+			uint fileSizeInHole = getInt(data, pos);
+			bool validSignature = getSignatureOptions(sig, package.signature_options);
 			
-			if(sig == SIGNATURE && fileSizeInHole == fileSize) {
+			if(validSignature && fileSizeInHole == fileSize) {
 				//the package has been compressed by this compressor in the past and has not changed since
 				package.signature_in_package = true;
 			}
+			
+			//a hole that only looks like the table is ignored
+			if(mode == RECOMPRESS && validSignature && !package.signature_in_package && hole.size >= 16 && getInt(data, pos) == SIGNATURE_VERSION) {
+				uint count = getInt(data, pos);
+				
+				if(count == (hole.size - 16) / FINGERPRINT_SIZE && (hole.size - 16) % FINGERPRINT_SIZE == 0) {
+					data = file.read(hole.location + 16, hole.size - 16, buffer);
+					pos = 0;
+					
+					fingerprints.reserve(count);
+					
+					for(uint i = 0; i < count; i++) {
+						uint key = getInt(data, pos);
+						
+						Fingerprint fingerprint;
+						fingerprint.hash = getInt(data, pos);
+						fingerprint.hash += (unsigned long long) getInt(data, pos) << 32;
+						fingerprint.signature = getInt(data, pos);
+						fingerprint.uncompressedSize = getInt(data, pos);
+						
+						//when two entries have the same key only the first one is kept, the other one is compressed again
+						fingerprints.insert({key, fingerprint});
+					}
+				}
+			}
 		}
 		
 		//index
-		buffer = readFile(file, package.header.indexLocation, package.header.indexSize);
+		data = file.read(package.header.indexLocation, package.header.indexSize, buffer);
 		pos = 0;
 		
 		package.entries.reserve(package.header.indexEntryCount + 1);
-		bytes clstContent;
+		bytes clstBuffer;
+		Span clstContent;
 		
 		for(uint i = 0; i < package.header.indexEntryCount; i++) {
-			uint type = getInt(buffer, pos);
-			uint group = getInt(buffer, pos);
-			uint instance = getInt(buffer, pos);
+			uint type = getInt(data, pos);
+			uint group = getInt(data, pos);
+			uint instance = getInt(data, pos);
 			uint resource = 0;
 
 			if(package.header.indexMinorVersion == 2) {
-				resource = getInt(buffer, pos);
+				resource = getInt(data, pos);
 			}
 
-			uint location = getInt(buffer, pos);
-			uint size = getInt(buffer, pos);
+			uint location = getInt(data, pos);
+			uint size = getInt(data, pos);
 			
 			if(location > fileSize || location + size > fileSize) {
-				wcout << displayPath << L": Entry location outside of bounds" << endl;
+				printError(displayPath, L"Entry location outside of bounds");
 				return Package{false}; 
 			}
 			
 			if(type == 0xE86B1EEF) {
-				clstContent = readFile(file, location, size);
+				clstContent = file.read(location, size, clstBuffer);
 				
 			} else {
 				Entry entry = Entry{type, group, instance, resource, location, size};
@@ -410,70 +1586,134 @@ namespace dbpf {
 				}
 			}
 		}
+		
+		//the entries that are in the table, the hash tells later if they are still the same
+		if(!fingerprints.empty()) {
+			for(auto& entry: package.entries) {
+				auto iter = fingerprints.find(getFingerprintKey(entry));
+				
+				if(iter != fingerprints.end() && !entry.repeated && iter->second.uncompressedSize == (entry.compressed ? entry.uncompressedSize : 0)) {
+					entry.fingerprint = iter->second.hash;
+					entry.fingerprintSignature = iter->second.signature;
+				}
+			}
+		}
 
 		return package;
 	}
-
-	//put package in file
-	void putPackage(fstream& newFile, fstream& oldFile, Package& package, Mode mode) {
-		//write header
-		bytes buffer = bytes(96);
-		uint pos = 0;
+	
+	//true if the entry is still the same as when this compressor stored it with settings that don't need it to be compressed again,
+	//then compressing it again would only make the same entry, so it's copied as it is
+	bool isUnchanged(Entry& entry, Span content, Options& options) {
+		Options signatureOptions;
 		
-		putInt(buffer, pos, DBPF_MAGIC);
-		putInt(buffer, pos, package.header.majorVersion);
-		putInt(buffer, pos, package.header.minorVersion);
-		putInt(buffer, pos, package.header.majorUserVersion);
-		putInt(buffer, pos, package.header.minorUserVersion);
-		putInt(buffer, pos, package.header.flags);
-		putInt(buffer, pos, package.header.createdDate);
-		putInt(buffer, pos, package.header.modifiedDate);
-		putInt(buffer, pos, package.header.indexMajorVersion);
-		pos += 24; //skip index and hole info, update later
-		putInt(buffer, pos, package.header.indexMinorVersion);
-		copy(package.header.remainder.begin(), package.header.remainder.end(), buffer.begin() + 64);
-
-		writeFile(newFile, buffer);
+		return entry.fingerprintSignature != 0 && getSignatureOptions(entry.fingerprintSignature, signatureOptions) && isCompressedWith(signatureOptions, options)
+		&& xxh::hash64(content.data(), content.size()) == entry.fingerprint;
+	}
 
-		//compress and write entries, and save the location and size for the index
-		omp_lock_t r_lock;
-		omp_lock_t w_lock;
-		
-		omp_init_lock(&r_lock);
-		omp_init_lock(&w_lock);
+	//put package in file
+	//compress, decompress, or copy one entry for putPackage and return its new content
+	//verified is set to false if the new entry doesn't decompress back to the old entry, this is only checked for VALIDATE_FUSED
+	bytes putEntry(Entry& entry, Span oldContent, Mode mode, Options& options, bool& verified) {
+		bytes content;
 		
-		#pragma omp parallel for
-		for(int i = 0; i < package.entries.size(); i++) {
-			auto& entry = package.entries[i];
-			
-			omp_set_lock(&r_lock);
-			bytes content = readFile(oldFile, entry.location, entry.size);
-			omp_unset_lock(&r_lock);
-			
-			if(mode == RECOMPRESS) {
-				content = recompressEntry(entry, content);
-			} else if(mode == DECOMPRESS) {
-				content = decompressEntry(entry, content);
+		if(mode == RECOMPRESS) {
+			if(isUnchanged(entry, oldContent, options)) {
+				Stats& stats = getStats();
+				content = bytes(oldContent.begin(), oldContent.end());
+				
+				#pragma omp atomic
+				stats.unchangedEntries++;
+				
+				#pragma omp atomic
+				stats.unchangedBytes += content.size();
+				
+				//the hash has to be of the uncompressed content, which costs a decompression but no compression
+				if(options.validation == VALIDATE_HASH) {
+					Entry copy = entry;
+					bytes uncompressedContent = decompressEntry(copy, oldContent);
+					entry.hash = xxh::hash64(uncompressedContent.data(), uncompressedContent.size());
+				}
+			} else {
+				content = recompressEntry(entry, oldContent, options, getContext(), verified);
+				entry.fingerprintSignature = getSignature(options);
 			}
 			
-			entry.size = content.size();
+			entry.fingerprint = xxh::hash64(content.data(), content.size());
 			
-			//we only care about the uncompressed size if the file is compressed
-			if(entry.compressed) {
-				entry.uncompressedSize = getUncompressedSize(content);
+		} else if(mode == DECOMPRESS) {
+			content = decompressEntry(entry, oldContent);
+			
+			if(options.validation == VALIDATE_HASH) {
+				entry.hash = xxh::hash64(content.data(), content.size());
 			}
+		} else {
+			content = bytes(oldContent.begin(), oldContent.end());
+		}
+		
+		entry.size = content.size();
+		
+		//we only care about the uncompressed size if the file is compressed
+		if(entry.compressed) {
+			entry.uncompressedSize = getUncompressedSize(content);
+		}
+		
+		return content;
+	}
+	
+	/*write the new content of entries[start] to entries[end - 1] one after another from location in index order, returns the location after them
+	the location of an entry only depends on the sizes of the entries before it, so the new file is the same no matter which thread finished first
+	each entry has its own part of the file, so the writes don't need a lock, a failed write shows in newFile.good()*/
+	uint writeEntries(OutputFile& newFile, vector<Entry>& entries, int start, int end, vector<bytes>& contents, uint location) {
+		vector<uint> positions;
+		vector<bytes*> bufs;
+		
+		for(int i = start; i < end; i++) {
+			entries[i].location = location;
+			location += contents[i].size();
 			
-			omp_set_lock(&w_lock);
+			positions.push_back(entries[i].location);
+			bufs.push_back(&contents[i]);
+		}
+		
+		newFile.write(positions, bufs);
+		
+		for(int i = start; i < end; i++) {
+			contents[i] = bytes();
+		}
+		
+		return location;
+	}
+	
+	//write the directory of compressed files, the index, the compressor signature, and the header, after the entries that end at location
+	void putIndex(OutputFile& newFile, Package& package, uint location, Mode mode, Options& options) {
+		//make the table of entries for the signature hole, before the directory of compressed files is added to the entries
+		bytes fingerprints;
+		uint pos = 0;
+		
+		if(mode == RECOMPRESS) {
+			fingerprints = bytes(8 + package.entries.size() * FINGERPRINT_SIZE);
+			putInt(fingerprints, pos, SIGNATURE_VERSION);
+			pos += 4; //count
 			
-			entry.location = newFile.tellp();
-			writeFile(newFile, content);
+			uint count = 0;
 			
-			omp_unset_lock(&w_lock);
+			for(auto& entry: package.entries) {
+				if(!entry.repeated) {
+					putInt(fingerprints, pos, getFingerprintKey(entry));
+					putInt(fingerprints, pos, entry.fingerprint);
+					putInt(fingerprints, pos, entry.fingerprint >> 32);
+					putInt(fingerprints, pos, entry.fingerprintSignature);
+					putInt(fingerprints, pos, entry.compressed ? entry.uncompressedSize : 0);
+					count++;
+				}
+			}
+			
+			fingerprints.resize(pos);
+			pos = 4;
+			putInt(fingerprints, pos, count);
 		}
 		
-		omp_destroy_lock(&r_lock);
-		omp_destroy_lock(&w_lock);
-		
 		//make and write the directory of compressed files
 		bytes clstContent;
 		pos = 0;
@@ -484,7 +1724,7 @@ namespace dbpf {
 			clstContent = bytes(package.entries.size() * 4 * 4);
 		}
 		
-		Entry clst = Entry{0xE86B1EEF, 0xE86B1EEF, 0x286B1F03, 0, (uint) newFile.tellp(), 0};
+		Entry clst = Entry{0xE86B1EEF, 0xE86B1EEF, 0x286B1F03, 0, location, 0};
 
 		for(auto& entry: package.entries) {
 			if(entry.compressed) {
@@ -504,12 +1744,14 @@ namespace dbpf {
 		
 		if(clst.size > 0) { 
 			clstContent.resize(clst.size);
-			writeFile(newFile, clstContent);
+			newFile.write(location, clstContent);
+			location += clst.size;
 			package.entries.push_back(clst);
 		}
 
 		//write the index
-		uint indexStart = newFile.tellp();
+		uint indexStart = location;
+		bytes buffer;
 		
 		if(package.header.indexMinorVersion == 2) {
 			buffer = bytes(package.entries.size() * 4 * 6);
@@ -532,36 +1774,45 @@ namespace dbpf {
 			putInt(buffer, pos, entry.size);
 		}
 		
-		writeFile(newFile, buffer);
-		uint indexEnd = newFile.tellp();
+		newFile.write(location, buffer);
+		uint indexEnd = indexStart + buffer.size();
 		
 		//write compressor signature as a hole and write the hole index
 		uint holeIndexLocation = indexEnd;
 		
 		if(mode == RECOMPRESS) {
 			uint holeLocation = holeIndexLocation + 8;
-			uint fileSize = holeLocation + 8;
+			uint holeSize = 8 + fingerprints.size();
+			uint fileSize = holeLocation + holeSize;
 			
-			buffer = bytes(16);
+			buffer = bytes(16 + fingerprints.size());
 			pos = 0;
 			
 			//hole index
 			putInt(buffer, pos, holeLocation);
-			putInt(buffer, pos, 8); //hole size
+			putInt(buffer, pos, holeSize);
 			
 			//hole
-			putInt(buffer, pos, SIGNATURE);
+			putInt(buffer, pos, getSignature(options));
 			putInt(buffer, pos, fileSize);
+			copy(fingerprints.begin(), fingerprints.end(), buffer.begin() + pos);
 			
-			writeFile(newFile, buffer);
+			newFile.write(holeIndexLocation, buffer);
 		}
 
-		//update the header with index info
-		newFile.seekp(36);
-		
-		buffer = bytes(24);
+		//write the header last, now that the index info is known
+		buffer = bytes(96);
 		pos = 0;
 		
+		putInt(buffer, pos, DBPF_MAGIC);
+		putInt(buffer, pos, package.header.majorVersion);
+		putInt(buffer, pos, package.header.minorVersion);
+		putInt(buffer, pos, package.header.majorUserVersion);
+		putInt(buffer, pos, package.header.minorUserVersion);
+		putInt(buffer, pos, package.header.flags);
+		putInt(buffer, pos, package.header.createdDate);
+		putInt(buffer, pos, package.header.modifiedDate);
+		putInt(buffer, pos, package.header.indexMajorVersion);
 		putInt(buffer, pos, package.entries.size()); //index entry count
 		putInt(buffer, pos, indexStart); //index location
 		putInt(buffer, pos, indexEnd - indexStart); //index size
@@ -570,9 +1821,264 @@ namespace dbpf {
 			putInt(buffer, pos, 1); //hole index entry count
 			putInt(buffer, pos, holeIndexLocation); //hole index location
 			putInt(buffer, pos, 8); //hole index size
-		} //else the rest is zero
+		} else {
+			pos += 12; //no holes
+		}
+		
+		putInt(buffer, pos, package.header.indexMinorVersion);
+		copy(package.header.remainder.begin(), package.header.remainder.end(), buffer.begin() + 64);
+		
+		newFile.write(0, buffer);
+	}
+	
+	//returns false if one of the compressed entries doesn't decompress back to the old entry, or if the new package couldn't be written completely
+	bool putPackage(OutputFile& newFile, InputFile& oldFile, Package& package, Mode mode, Options& options) {
+		uint mismatches = 0;
+		
+		auto getContent = [&](Entry& entry, Span oldContent) {
+			bool verified = true;
+			bytes content = putEntry(entry, oldContent, mode, options, verified);
+			
+			if(!verified) {
+				#pragma omp atomic
+				mismatches++;
+			}
+			
+			return content;
+		};
+		
+		//the sizes of the entries are only known after compression, so the entries are compressed in windows and the new content of a window is kept until it's written
+		vector<bytes> contents = vector<bytes>(package.entries.size());
+		uint location = 96;
+		int start = 0;
+		
+		while(start < package.entries.size()) {
+			int end = getWindowEnd(package.entries, start, options);
+			vector<bytes> buffers;
+			vector<Span> oldContents = readEntries(oldFile, package.entries, start, end, buffers);
+			
+			//large entries are compressed one at a time with all threads working on the segments of the entry,
+			//then the other entries of the window are compressed in parallel with each other
+			vector<int> smallEntries;
+			
+			for(int i = start; i < end; i++) {
+				auto& entry = package.entries[i];
+				uint size = entry.compressed ? entry.uncompressedSize : entry.size;
+				
+				if(mode == RECOMPRESS && size >= options.splitSize) {
+					contents[i] = getContent(entry, oldContents[i - start]);
+				} else {
+					smallEntries.push_back(i);
+				}
+			}
+			
+			#pragma omp parallel for
+			for(int i = 0; i < smallEntries.size(); i++) {
+				contents[smallEntries[i]] = getContent(package.entries[smallEntries[i]], oldContents[smallEntries[i] - start]);
+			}
+			
+			buffers.clear();
+			location = writeEntries(newFile, package.entries, start, end, contents, location);
+			start = end;
+			
+			//no need to compress the rest if the package can't be written
+			if(!newFile.good()) {
+				return false;
+			}
+		}
+		
+		putIndex(newFile, package, location, mode, options);
+		return mismatches == 0 && newFile.good();
+	}
+	
+	//putPackage keeps the hashes for VALIDATE_HASH in the entries of the package that it wrote, validatePackage needs them in the entries of the old package
+	void copyHashes(Package& package, Package& oldPackage) {
+		for(uint i = 0; i < oldPackage.entries.size(); i++) {
+			oldPackage.entries[i].hash = package.entries[i].hash;
+		}
+	}
+	
+	//checks if the new package file is valid
+	bool validatePackage(Package& oldPackage, Package& newPackage, InputFile& oldFile, InputFile& newFile, wstring displayPath, Mode mode, Options& options) {
+		//package unpacking failed, getPackage already prints an error
+		if(!newPackage.unpacked) {
+			return false;
+		}
+		
+		//compare headers
+		bytes oldBuffer, newBuffer;
+		Span oldHeader = oldFile.read(0, 96, oldBuffer);
+		Span newHeader = newFile.read(0, 96, newBuffer);
+		
+		if(bytes(oldHeader.begin(), oldHeader.begin() + 36) != bytes(newHeader.begin(), newHeader.begin() + 36)
+		|| bytes(oldHeader.begin() + 60, oldHeader.end()) != bytes(newHeader.begin() + 60, newHeader.end())) {
+			printError(displayPath, L"New header does not match the old header");
+			return false;
+		}
+		
+		if(mode == RECOMPRESS) {
+			//should only have one hole for the compressor signature
+			if(newPackage.header.holeIndexEntryCount != 1) {
+				printError(displayPath, L"Wrong hole index count");
+				return false;
+			}
+			
+			//one hole index entry is 8 bytes long
+			if(newPackage.header.holeIndexSize != 8) {
+				printError(displayPath, L"Wrong hole index size");
+				return false;
+			}
+			
+			Hole hole = newPackage.holes[0];
+			
+			//compressor signature is 8 bytes long, followed by the version, the entry count, and the table of entries
+			if(hole.size < 16 || (hole.size - 16) % FINGERPRINT_SIZE != 0) {
+				printError(displayPath, L"Wrong hole size");
+				return false;
+			}
+			
+			Span holeData = newFile.read(hole.location, 16, newBuffer);
+			uint pos = 8;
+			
+			if(getInt(holeData, pos) != SIGNATURE_VERSION || getInt(holeData, pos) != (hole.size - 16) / FINGERPRINT_SIZE) {
+				printError(displayPath, L"Wrong table of entries in signature");
+				return false;
+			}
+			
+			pos = 0;
+			
+			uint sig = getInt(holeData, pos);
+			
+			//if the file was compressed then the signature should match the compression settings
+			if(sig != getSignature(options)) {
+				printError(displayPath, L"Compressor signature not found");
+				return false;
+			}
+			
+			uint fileSizeInHole = getInt(holeData, pos);
+			uint fileSize = newFile.getSize();
+			
+			//file size written in the hole should match the actual file size
+			if(fileSizeInHole != fileSize) {
+				printError(displayPath, L"File size in signature does not match the actual file size");
+				return false;
+			}
+		}
+		
+		//should have the exact number of entries as the original package
+		//NOTE: getPackage does not include the directory of compressed files entry in the entries vector for both packages
+		if(oldPackage.entries.size() != newPackage.entries.size()) {
+			printError(displayPath, L"Number of entries between old package and new package not matching");
+			return false;
+		}
+		
+		//compare entries, they are read in windows like putPackage reads them
+		//the content of the old entries is only needed for full validation, otherwise putPackage already compared it with the new entries or kept its hash
+		int start = 0;
+		
+		while(start < oldPackage.entries.size()) {
+			int end = getWindowEnd(oldPackage.entries, start, options);
+			vector<bytes> oldBuffers, newBuffers;
+			vector<Span> oldContents;
+			vector<Span> newContents = readEntries(newFile, newPackage.entries, start, end, newBuffers);
+			
+			if(options.validation == VALIDATE_FULL) {
+				oldContents = readEntries(oldFile, oldPackage.entries, start, end, oldBuffers);
+			}
+			
+			for(int i = start; i < end; i++) {
+				auto& oldEntry = oldPackage.entries[i];
+				auto& newEntry = newPackage.entries[i];
+				
+				//compare TGIRs
+				if(oldEntry.type != newEntry.type || oldEntry.group != newEntry.group || oldEntry.instance != newEntry.instance || oldEntry.resource != newEntry.resource) {
+					printError(displayPath, L"Types, groups, instances, or resources of entries not matching");
+					return false;
+				}
+				
+				//check entry content
+				Span newContent = newContents[i - start];
+				
+				//compression info in the directory of compressed files should match the information in the compression header
+				//the compressed size is checked as well, uncompressed entries can start with the same bytes as a compression header by chance
+				uint headerPos = 0;
+				bool compressed_in_header = newContent.size() >= 9 && newContent[4] == 0x10 && newContent[5] == 0xFB && getInt(newContent, headerPos) == newContent.size();
+				auto iter = newPackage.compressedEntries.find(CompressedEntry{newEntry.type, newEntry.group, newEntry.instance, newEntry.resource});
+				bool in_clst = iter != newPackage.compressedEntries.end();
+				
+				if(compressed_in_header != in_clst) {
+					printError(displayPath, L"Incorrect compression information");
+					return false;
+				}
+				
+				if(newEntry.compressed) {
+					uint tempPos = 0;
+					uint uncompressedSize = getUncompressedSize(newContent);
+					uint compressedSize = getInt(newContent, tempPos);
+					
+					if(uncompressedSize != iter->uncompressedSize) {
+						printError(displayPath, L"Mismatch between the uncompressed size in the compression header and the uncompressed size in the CLST");
+						return false;
+					}
+					
+					if(compressedSize != newEntry.size) {
+						printError(displayPath, L"Mismatch between the compressed size in the compression header and the compressed size in the index");
+						return false;
+					}
+					
+					//the compressor should only produce compressed entries that are smaller than the original decompressed entries
+					if(compressedSize > uncompressedSize) {
+						printError(displayPath, L"Compressed size is larger than the uncompressed size for one entry");
+						return false;
+					}
+				}
+				
+				//decompress the entries and compare them
+				if(options.validation == VALIDATE_FULL && decompressEntry(oldEntry, oldContents[i - start]) != decompressEntry(newEntry, newContent)) {
+					printError(displayPath, L"Mismatch between old entry and new entry");
+					return false;
+				}
+			}
+			
+			//decompress and hash the new entries in parallel, with one buffer for each thread
+			if(options.validation == VALIDATE_HASH) {
+				uint mismatches = 0;
+				
+				#pragma omp parallel
+				{
+					bytes buffer;
+					
+					#pragma omp for
+					for(int i = start; i < end; i++) {
+						Span content = newContents[i - start];
+						
+						//an entry that fails to decompress is kept as it is by putPackage, so it's hashed as it is
+						if(newPackage.entries[i].compressed) {
+							buffer.resize(getUncompressedSize(content));
+							
+							if(qfs_decompress(content.data(), content.size(), buffer.data(), buffer.size(), false)) {
+								content = Span(buffer);
+							}
+						}
+						
+						if(xxh::hash64(content.data(), content.size()) != oldPackage.entries[i].hash) {
+							#pragma omp atomic
+							mismatches++;
+						}
+					}
+				}
+				
+				if(mismatches > 0) {
+					printError(displayPath, L"Mismatch between old entry and new entry");
+					return false;
+				}
+			}
+			
+			start = end;
+		}
 		
-		writeFile(newFile, buffer);
+		//if all passes then return true
+		return true;
 	}
 	
 }
@@ -0,0 +1,108 @@
+#ifndef HASH_H
+#define HASH_H
+
+//64 bit XXH64 hash for checking that the entries of a new package have the same content as the entries of the old package
+//not a cryptographic hash, it's only meant to catch corruption, and to find copies of the same content for the compression cache
+
+#include <stddef.h>
+#include <string.h>
+
+namespace xxh {
+
+	const unsigned long long PRIME_1 = 0x9E3779B185EBCA87ULL;
+	const unsigned long long PRIME_2 = 0xC2B2AE3D27D4EB4FULL;
+	const unsigned long long PRIME_3 = 0x165667B19E3779F9ULL;
+	const unsigned long long PRIME_4 = 0x85EBCA77C2B2AE63ULL;
+	const unsigned long long PRIME_5 = 0x27D4EB2F165667C5ULL;
+
+	inline unsigned long long rotl(unsigned long long x, int r) {
+		return (x << r) | (x >> (64 - r));
+	}
+
+	//little endian reads, memcpy because the data is not aligned
+	inline unsigned long long read64(const unsigned char* p) {
+		unsigned long long n;
+		memcpy(&n, p, 8);
+		return n;
+	}
+
+	inline unsigned long long read32(const unsigned char* p) {
+		unsigned int n;
+		memcpy(&n, p, 4);
+		return n;
+	}
+
+	inline unsigned long long round(unsigned long long acc, unsigned long long input) {
+		acc += input * PRIME_2;
+		acc = rotl(acc, 31);
+		return acc * PRIME_1;
+	}
+
+	inline unsigned long long mergeRound(unsigned long long acc, unsigned long long val) {
+		acc ^= round(0, val);
+		return acc * PRIME_1 + PRIME_4;
+	}
+
+	inline unsigned long long hash64(const unsigned char* data, size_t size, unsigned long long seed = 0) {
+		const unsigned char* p = data;
+		const unsigned char* end = data + size;
+		unsigned long long h;
+
+		//four lanes of 8 bytes
+		if(size >= 32) {
+			unsigned long long v1 = seed + PRIME_1 + PRIME_2;
+			unsigned long long v2 = seed + PRIME_2;
+			unsigned long long v3 = seed;
+			unsigned long long v4 = seed - PRIME_1;
+
+			do {
+				v1 = round(v1, read64(p));
+				v2 = round(v2, read64(p + 8));
+				v3 = round(v3, read64(p + 16));
+				v4 = round(v4, read64(p + 24));
+				p += 32;
+			} while(p + 32 <= end);
+
+			h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+			h = mergeRound(h, v1);
+			h = mergeRound(h, v2);
+			h = mergeRound(h, v3);
+			h = mergeRound(h, v4);
+		} else {
+			h = seed + PRIME_5;
+		}
+
+		h += size;
+
+		//the remaining bytes
+		while(p + 8 <= end) {
+			h ^= round(0, read64(p));
+			h = rotl(h, 27) * PRIME_1 + PRIME_4;
+			p += 8;
+		}
+
+		if(p + 4 <= end) {
+			h ^= read32(p) * PRIME_1;
+			h = rotl(h, 23) * PRIME_2 + PRIME_3;
+			p += 4;
+		}
+
+		while(p < end) {
+			h ^= *p * PRIME_5;
+			h = rotl(h, 11) * PRIME_1;
+			p++;
+		}
+
+		//avalanche
+		h ^= h >> 33;
+		h *= PRIME_2;
+		h ^= h >> 29;
+		h *= PRIME_3;
+		h ^= h >> 32;
+
+		return h;
+	}
+
+}
+
+#endif
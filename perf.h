@@ -0,0 +1,132 @@
+#ifndef PERF_H
+#define PERF_H
+
+//hardware performance counters of the current thread for the benchmarks
+//they are read with perf_event_open on Linux, on other systems or when the kernel doesn't allow it
+//(perf_event_paranoid, virtual machines without a PMU) the counters are just unavailable
+
+#ifdef __linux__
+	#include <linux/perf_event.h>
+	#include <sys/ioctl.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+#endif
+
+#include <string.h>
+
+namespace perf {
+
+	enum Counter { CYCLES, INSTRUCTIONS, BRANCH_MISSES, L1D_MISSES, LLC_MISSES, COUNTER_COUNT };
+
+	const wchar_t* const COUNTER_NAMES[COUNTER_COUNT] = {L"cycles", L"instructions", L"branch_misses", L"l1d_misses", L"llc_misses"};
+
+	//all counters are in one group so that they count the same code when the kernel has to multiplex them
+	class Counters {
+		private:
+			int fds[COUNTER_COUNT];
+			int leader = -1;
+
+		#ifdef __linux__
+			int open(unsigned type, unsigned long long config) {
+				perf_event_attr attr;
+				memset(&attr, 0, sizeof(attr));
+				attr.size = sizeof(attr);
+				attr.type = type;
+				attr.config = config;
+				attr.disabled = leader == -1;
+				attr.exclude_kernel = 1;
+				attr.exclude_hv = 1;
+				attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+				return syscall(__NR_perf_event_open, &attr, 0, -1, leader, 0);
+			}
+		#endif
+
+		public:
+			Counters() {
+				for(int i = 0; i < COUNTER_COUNT; i++) {
+					fds[i] = -1;
+				}
+
+			#ifdef __linux__
+				const unsigned long long l1d = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+				const unsigned long long llc = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+
+				//counters that fail to open are skipped, the first one that opens leads the group
+				fds[CYCLES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+				leader = fds[CYCLES];
+				fds[INSTRUCTIONS] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+				leader = leader == -1 ? fds[INSTRUCTIONS] : leader;
+				fds[BRANCH_MISSES] = open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+				leader = leader == -1 ? fds[BRANCH_MISSES] : leader;
+				fds[L1D_MISSES] = open(PERF_TYPE_HW_CACHE, l1d);
+				leader = leader == -1 ? fds[L1D_MISSES] : leader;
+				fds[LLC_MISSES] = open(PERF_TYPE_HW_CACHE, llc);
+				leader = leader == -1 ? fds[LLC_MISSES] : leader;
+
+				if(leader != -1) {
+					ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+				}
+			#endif
+			}
+
+			Counters(const Counters&) = delete;
+			Counters& operator=(const Counters&) = delete;
+
+			~Counters() {
+			#ifdef __linux__
+				for(int i = 0; i < COUNTER_COUNT; i++) {
+					if(fds[i] != -1) {
+						close(fds[i]);
+					}
+				}
+			#endif
+			}
+
+			//true if at least one counter could be opened
+			bool available() {
+				return leader != -1;
+			}
+
+			bool available(Counter counter) {
+				return fds[counter] != -1;
+			}
+
+			//current totals of the counters, scaled up if the group was not counting all of the time
+			//returns false if the group couldn't be read or never ran
+			bool read(double values[COUNTER_COUNT]) {
+				for(int i = 0; i < COUNTER_COUNT; i++) {
+					values[i] = 0;
+				}
+
+			#ifdef __linux__
+				if(leader == -1) {
+					return false;
+				}
+
+				//number of counters, time enabled, time running, then the values in the order they were opened
+				unsigned long long buffer[3 + COUNTER_COUNT];
+
+				if(::read(leader, buffer, sizeof(buffer)) < (ssize_t) (3 * sizeof(unsigned long long)) || buffer[2] == 0) {
+					return false;
+				}
+
+				double scale = (double) buffer[1] / buffer[2];
+				unsigned long long n = 0;
+
+				for(int i = 0; i < COUNTER_COUNT && n < buffer[0]; i++) {
+					if(fds[i] != -1) {
+						values[i] = buffer[3 + n++] * scale;
+					}
+				}
+
+				return true;
+			#else
+				return false;
+			#endif
+			}
+	};
+
+}
+
+#endif
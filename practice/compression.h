@@ -1,15 +1,12 @@
 //(Unused) This is a simple implementation of the QFS compression
+//finder.h runs the same pattern matchers with the compressors of qfs.h
 
 #include "hash_chain.h"
-#include <vector>
+#include "map_multi.h"
+#include "map_single.h"
 
 namespace qfs {
 
-	using namespace std;
-
-	typedef unsigned int uint;
-	typedef vector<unsigned char> bytes;
-
 	//copy length bytes from src at srcPos to dst at dstPos and increment srcPos and dstPos
 	//copying one byte at a time is REQUIRED in some cases, otherwise decompression will not work
 	void copyBytes(bytes& src, uint& srcPos, bytes& dst, uint& dstPos, uint length) {
@@ -21,6 +18,8 @@ namespace qfs {
 	//compresses src, returns an empty vector if compression fails
 	//it will fail if the compressed output >= decompressed input since it's better to store these assets uncompressed
 	//this typically happens with very small assets
+	//Table is one of the pattern matchers: ChainTable, MultiMapTable or MapTable
+	template<class Table = ChainTable>
 	bytes compress(bytes& src) {
 		//compressed output has to smaller than the decompressed output, otherwise it's not useful
 		//maximum possible size of the compressed entry is 0xFFFFFF + 1 due to the fact that the compressed size in the header is only 3 bytes long
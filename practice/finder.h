@@ -0,0 +1,71 @@
+//Runs the pattern matchers with the compressors of qfs.h
+
+/*the tables are wrapped as match finders of qfs.h, which makes it possible to compare them with its own finders
+on the same compressor, use qfs_compress_finder to compress with them*/
+
+#ifndef PRACTICE_FINDER_H
+#define PRACTICE_FINDER_H
+
+#include "../qfs.h"
+#include "hash_chain.h"
+#include "map_multi.h"
+#include "map_single.h"
+
+namespace qfs {
+
+	//the tables have fixed limits (MAX_LOOPS, GOOD_LENGTH) so the compression level only affects the compressor
+	template<class Table>
+	class TableFinder {
+		private:
+			Table* table = nullptr;
+			
+		public:
+			TableFinder() {}
+			TableFinder(const TableFinder&) = delete;
+			TableFinder& operator=(const TableFinder&) = delete;
+			
+			~TableFinder() {
+				delete table;
+			}
+			
+			//the positions of the dictionary are added on the first insert
+			void start(const unsigned char* src, const qfs_segment& seg) {
+				delete table;
+				table = new Table(src, seg.end, seg.dict);
+			}
+			
+			bool insert(uint pos) {
+				table->addTo(pos);
+				return true;
+			}
+			
+			template<class Level>
+			uint longest(uint pos, uint remaining, uint prev_length, uint* match_start) {
+				Match match = table->getLongestMatch(pos);
+				
+				if(match.length <= prev_length || match.length < 3) {
+					return 2;
+				}
+				
+				*match_start = pos - match.offset;
+				return match.length;
+			}
+			
+			//only the longest match, the optimal compressor tries the shorter lengths of it
+			template<class Level>
+			uint all(uint pos, uint remaining, uint prev_length, qfs_match* matches) {
+				Match match = table->getLongestMatch(pos);
+				
+				if(match.length < 3) {
+					return 0;
+				}
+				
+				matches[0].length = match.length;
+				matches[0].distance = match.offset;
+				return 1;
+			}
+	};
+
+}
+
+#endif
@@ -8,33 +8,18 @@ it requires very little memory allocation/deallocation, and the allocation is on
 //Memory Usage: Good
 //Difficulty: Hard
 
-#include <vector>
+#ifndef PRACTICE_HASH_CHAIN_H
+#define PRACTICE_HASH_CHAIN_H
 
-namespace qfs {
-
-	using namespace std;
-
-	typedef unsigned int uint;
-	typedef vector<unsigned char> bytes;
-	
-	const uint GOOD_LENGTH = 32;
-	const uint MAX_LOOPS = 32;
-
-	template<typename T1, typename T2>
-	T1 getMin(T1 a, T2 b) {
-		return a <= b ? a : b;
-	}
+#include "table.h"
 
-	struct Match {
-		uint location;
-		uint length;
-		uint offset;
-	};
+namespace qfs {
 	
-	class Table {
+	class ChainTable {
 		private:
-			bytes& src;
-			uint lastPos = 0;
+			const unsigned char* src;
+			uint srcSize;
+			uint lastPos;
 
 			/*head is a hash map where the key is a hash created from a number of bytes in src
 			and the value is the last position where the bytes could be found*/
@@ -45,7 +30,7 @@ namespace qfs {
 			vector<uint> prev = vector<uint>(0x20000);
 			
 			uint getHash(uint pos) {
-				return ((uint) src[pos++] << 8) + src[pos];
+				return ((uint) src[pos] << 8) + src[pos + 1];
 			}
 			
 			//get the previous position that resolves to the same hash, or 0xFFFFFFFF if the position is invalid
@@ -59,7 +44,10 @@ namespace qfs {
 			}
 			
 		public:
-			Table(bytes& buffer): src(buffer) {}
+			ChainTable(bytes& buffer): src(buffer.data()), srcSize(buffer.size()), lastPos(0) {}
+			
+			//match over buffer[0, size), positions before start are not added to the table
+			ChainTable(const unsigned char* buffer, uint size, uint start = 0): src(buffer), srcSize(size), lastPos(start) {}
 			
 			//add all bytes between lastPos and pos to the hash chain
 			void addTo(uint pos) {
@@ -81,7 +69,7 @@ namespace qfs {
 				
 				while(prevPos != 0xFFFFFFFF && n_loops < MAX_LOOPS) {
 					uint length = 2;
-					uint maxLen = getMin(src.size() - pos, 1028);
+					uint maxLen = getMin(srcSize - pos, 1028);
 					
 					//find out how long the match is
 					//depending on the hashing function you might also need to check the first 2-3 bytes here
@@ -109,3 +97,5 @@ namespace qfs {
 	};
 
 }
+
+#endif
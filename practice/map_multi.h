@@ -5,43 +5,31 @@
 //Memory Usage: Bad
 //Difficulty: Medium
 
-#include <vector>
+#ifndef PRACTICE_MAP_MULTI_H
+#define PRACTICE_MAP_MULTI_H
 
-namespace qfs {
-	
-	using namespace std;
-
-	typedef unsigned int uint;
-	typedef vector<unsigned char> bytes;
-	
-	const uint GOOD_LENGTH = 32;
-	const uint MAX_LOOPS = 32;
-
-	template<typename T1, typename T2>
-	T1 getMin(T1 a, T2 b) {
-		return a <= b ? a : b;
-	}
+#include "table.h"
 
-	struct Match {
-		uint location;
-		uint length;
-		uint offset;
-	};
+namespace qfs {
 	
 	/*hashtable where the keys are 2 bytes sequences from src converted to integers
 	and the values are a list of the positions where the 2 bytes sequence could be found*/
-	class Table {
+	class MultiMapTable {
 		private:
-			bytes& src;
+			const unsigned char* src;
+			uint srcSize;
 			vector<vector<uint>> map = vector<vector<uint>>(65536, vector<uint>());
-			uint lastPos = 0;
+			uint lastPos;
 			
 			uint getHash(uint pos) {
-				return ((uint) src[pos++] << 8) + src[pos];
+				return ((uint) src[pos] << 8) + src[pos + 1];
 			}
 			
 		public:
-			Table(bytes& buffer): src(buffer) {}
+			MultiMapTable(bytes& buffer): src(buffer.data()), srcSize(buffer.size()), lastPos(0) {}
+			
+			//match over buffer[0, size), positions before start are not added to the table
+			MultiMapTable(const unsigned char* buffer, uint size, uint start = 0): src(buffer), srcSize(size), lastPos(start) {}
 			
 			//add all bytes between [lastPos, pos) to the table
 			void addTo(uint pos) {
@@ -71,7 +59,7 @@ namespace qfs {
 					
 					uint length = 2;
 					uint offset = pos - prevPos;
-					uint maxLen = getMin(src.size() - pos, 1028);
+					uint maxLen = getMin(srcSize - pos, 1028);
 
 					if(offset > 131072) {
 						break;
@@ -97,3 +85,5 @@ namespace qfs {
 	};
 
 }
+
+#endif
@@ -5,41 +5,32 @@
 //Memory Usage: Okay
 //Difficulty: Easy
 
+#ifndef PRACTICE_MAP_SINGLE_H
+#define PRACTICE_MAP_SINGLE_H
+
+#include "table.h"
 #include <unordered_map>
-#include <vector>
 
 namespace qfs {
 
-	using namespace std;
-
-	typedef unsigned int uint;
-	typedef vector<unsigned char> bytes;
-
-	template<typename T1, typename T2>
-	T1 getMin(T1 a, T2 b) {
-		return a <= b ? a : b;
-	}
-
-	struct Match {
-		uint location;
-		uint length;
-		uint offset;
-	};
-
 	/*hashtable where the keys are 3 bytes sequences from src converted to integers
 	and the values are the last position where the 3 bytes sequence could be found*/
-	class Table {
+	class MapTable {
 		private:
-			bytes& src;
+			const unsigned char* src;
+			uint srcSize;
 			unordered_map<uint, uint> map;
-			uint lastPos = 0;
+			uint lastPos;
 			
 			uint getHash(uint pos) {
-				return ((uint) src[pos++] << 16) + ((uint) src[pos++] << 8) + src[pos];
+				return ((uint) src[pos] << 16) + ((uint) src[pos + 1] << 8) + src[pos + 2];
 			}
 			
 		public:
-			Table(bytes& buffer): src(buffer) {}
+			MapTable(bytes& buffer): src(buffer.data()), srcSize(buffer.size()), lastPos(0) {}
+			
+			//match over buffer[0, size), positions before start are not added to the table
+			MapTable(const unsigned char* buffer, uint size, uint start = 0): src(buffer), srcSize(size), lastPos(start) {}
 			
 			//add all bytes between [lastPos, pos) to the table
 			void addTo(uint pos) {
@@ -67,7 +58,7 @@ namespace qfs {
 				}
 				
 				uint length = 3;
-				uint maxLen = getMin(src.size() - pos, 1028);
+				uint maxLen = getMin(srcSize - pos, 1028);
 				
 				while(length < maxLen && src[prevPos + length] == src[pos + length]) {
 					length++;
@@ -81,3 +72,5 @@ namespace qfs {
 			}
 	};
 }
+
+#endif
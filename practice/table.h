@@ -0,0 +1,31 @@
+//Shared definitions of the pattern matchers
+
+#ifndef PRACTICE_TABLE_H
+#define PRACTICE_TABLE_H
+
+#include <vector>
+
+namespace qfs {
+
+	using namespace std;
+
+	typedef unsigned int uint;
+	typedef vector<unsigned char> bytes;
+
+	const uint GOOD_LENGTH = 32;
+	const uint MAX_LOOPS = 32;
+
+	template<typename T1, typename T2>
+	T1 getMin(T1 a, T2 b) {
+		return a <= b ? a : b;
+	}
+
+	struct Match {
+		uint location;
+		uint length;
+		uint offset;
+	};
+
+}
+
+#endif
@@ -0,0 +1,591 @@
+#include "console.h"
+#include "dbpf.h"
+#include "perf.h"
+#include "practice/finder.h"
+
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+//benchmarks the compressors on the entries of real packages, for every encoder, match finder and level
+//compression and decompression speeds are the medians of a number of runs, broken down by the type of the entries
+//with -p it also reports hardware performance counters of the compression per input byte (Linux only)
+
+typedef int (*CompressFunction)(qfs_context& context, bytes& content, bytes& buffer, int level);
+
+struct Codec {
+	const wchar_t* encoder;
+	const wchar_t* matcher;
+	CompressFunction compress;
+	int engine; //engine of qfs_compress, -1 for the matchers that are run with qfs_compress_finder
+};
+
+template<qfs_engine engine>
+int compressEngine(qfs_context& context, bytes& content, bytes& buffer, int level) {
+	return qfs_compress(context, content.data(), content.size(), buffer.data(), level, engine);
+}
+
+template<class Table, qfs_engine engine>
+int compressTable(qfs_context& context, bytes& content, bytes& buffer, int level) {
+	qfs::TableFinder<Table> finder;
+	return qfs_compress_finder(context, finder, content.data(), content.size(), buffer.data(), level, engine);
+}
+
+//the p- matchers are the pattern matchers in practice/
+const Codec CODECS[] = {
+	{L"lazy", L"chain", compressEngine<QFS_ENGINE_CHAIN>, QFS_ENGINE_CHAIN},
+	{L"lazy", L"dual", compressEngine<QFS_ENGINE_DUAL>, QFS_ENGINE_DUAL},
+	{L"lazy", L"bt", compressEngine<QFS_ENGINE_BT>, QFS_ENGINE_BT},
+	{L"lazy", L"p-chain", compressTable<qfs::ChainTable, QFS_ENGINE_CHAIN>, -1},
+	{L"lazy", L"p-multi", compressTable<qfs::MultiMapTable, QFS_ENGINE_CHAIN>, -1},
+	{L"lazy", L"p-map", compressTable<qfs::MapTable, QFS_ENGINE_CHAIN>, -1},
+	{L"optimal", L"chain", compressEngine<QFS_ENGINE_OPTIMAL>, QFS_ENGINE_OPTIMAL},
+	{L"optimal", L"bt", compressEngine<QFS_ENGINE_OPTIMAL_BT>, QFS_ENGINE_OPTIMAL_BT},
+	{L"optimal", L"p-chain", compressTable<qfs::ChainTable, QFS_ENGINE_OPTIMAL>, -1},
+	{L"optimal", L"p-multi", compressTable<qfs::MultiMapTable, QFS_ENGINE_OPTIMAL>, -1},
+	{L"optimal", L"p-map", compressTable<qfs::MapTable, QFS_ENGINE_OPTIMAL>, -1},
+	{L"fast", L"hash", compressEngine<QFS_ENGINE_FAST>, QFS_ENGINE_FAST},
+};
+
+const wchar_t* const KERNEL_NAMES[] = {L"scalar", L"word", L"sse2", L"avx2"};
+
+enum Format { TEXT, CSV, JSON };
+
+struct Sample {
+	uint type;
+	bytes content;
+};
+
+//totals of one type, the times have one value per run
+struct Result {
+	uint entries = 0;
+	unsigned long long size = 0;
+	unsigned long long compressedSize = 0;
+	unsigned long long decompressedSize = 0; //size of the entries that were compressed, the others are stored as they are and take no time to decompress
+	uint errors = 0;
+	vector<double> compressSeconds;
+	vector<double> decompressSeconds;
+	vector<double> counters[perf::COUNTER_COUNT];
+};
+
+//load the uncompressed entries of a package
+void loadEntries(wstring fileName, wstring displayPath, vector<Sample>& samples) {
+	fstream file = fstream(dbpf::toPath(fileName), ios::in | ios::binary);
+
+	if(!file.is_open()) {
+		wcerr << displayPath << L": Failed to open file" << endl;
+		return;
+	}
+
+	dbpf::InputFile input = dbpf::InputFile(file, fileName);
+	dbpf::Package package = dbpf::getPackage(input, displayPath, dbpf::DECOMPRESS);
+
+	if(package.unpacked) {
+		for(auto& entry: package.entries) {
+			bytes buffer;
+			dbpf::Span content = input.read(entry.location, entry.size, buffer);
+			samples.push_back(Sample{entry.type, dbpf::decompressEntry(entry, content)});
+		}
+	}
+
+	input.close();
+	file.close();
+}
+
+bool isSelected(const Codec& codec, wstring& encoder, wstring& matcher) {
+	return (encoder.empty() || encoder == codec.encoder) && (matcher.empty() || matcher == codec.matcher);
+}
+
+//compress every sample on its own, incompressible samples have an empty output
+vector<bytes> compressSamples(qfs_context& context, const Codec& codec, int level, vector<Sample>& samples) {
+	vector<bytes> outputs;
+	outputs.reserve(samples.size());
+
+	for(auto& sample: samples) {
+		bytes buffer = bytes(sample.content.size());
+		int length = codec.compress(context, sample.content, buffer, level);
+		buffer.resize(length > 0 ? length : 0);
+		outputs.push_back(move(buffer));
+	}
+
+	return outputs;
+}
+
+//compress all of the samples with one call to qfs_compress_batch, returns the number of samples that don't come out the same as when they are compressed on their own
+uint checkBatch(qfs_context& context, const Codec& codec, int level, vector<Sample>& samples) {
+	vector<bytes> expected = compressSamples(context, codec, level, samples);
+
+	vector<const unsigned char*> srcs;
+	vector<int> srclens;
+	vector<bytes> buffers = vector<bytes>(samples.size());
+	vector<unsigned char*> dsts;
+	vector<int> dstlens = vector<int>(samples.size());
+
+	for(uint i = 0; i < samples.size(); i++) {
+		buffers[i] = bytes(samples[i].content.size());
+		srcs.push_back(samples[i].content.data());
+		srclens.push_back(samples[i].content.size());
+		dsts.push_back(buffers[i].data());
+	}
+
+	qfs_compress_batch(context, samples.size(), srcs.data(), srclens.data(), dsts.data(), dstlens.data(), level, codec.engine);
+	uint mismatches = 0;
+
+	for(uint i = 0; i < samples.size(); i++) {
+		buffers[i].resize(dstlens[i] > 0 ? dstlens[i] : 0);
+
+		if(buffers[i] != expected[i]) {
+			mismatches++;
+		}
+	}
+
+	return mismatches;
+}
+
+//compress the samples with the match length kernel, returns the number of samples that don't come out the same as expected
+uint checkKernel(qfs_context& context, const Codec& codec, int level, vector<Sample>& samples, int kernel, vector<bytes>& expected) {
+	qfs_use_kernel(kernel);
+	vector<bytes> outputs = compressSamples(context, codec, level, samples);
+	uint mismatches = 0;
+
+	for(uint i = 0; i < samples.size(); i++) {
+		if(outputs[i] != expected[i]) {
+			mismatches++;
+		}
+	}
+
+	return mismatches;
+}
+
+double median(vector<double> values) {
+	sort(values.begin(), values.end());
+	size_t middle = values.size() / 2;
+	return values.size() % 2 == 1 ? values[middle] : (values[middle - 1] + values[middle]) / 2;
+}
+
+wstring typeName(uint type) {
+	wostringstream stream;
+	stream << L"0x" << hex << uppercase << setw(8) << setfill(L'0') << type;
+	return stream.str();
+}
+
+const wchar_t* const COUNTER_HEADERS[perf::COUNTER_COUNT] = {L"cycles/B", L"instr/B", L"br-miss/B", L"L1d-miss/B", L"LLC-miss/B"};
+
+void printHeader(Format format, perf::Counters* counters) {
+	if(format == TEXT) {
+		wcout << L"encoder  matcher  level  type        entries   compress MB/s  decompress MB/s     ratio";
+
+		if(counters) {
+			for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+				wcout << setw(12) << COUNTER_HEADERS[i];
+			}
+		}
+
+		wcout << endl;
+
+	} else if(format == CSV) {
+		wcout << L"encoder,matcher,level,type,entries,size,compressed_size,ratio,compress_mbs,decompress_mbs,runs,errors";
+
+		if(counters) {
+			for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+				wcout << L"," << perf::COUNTER_NAMES[i] << L"_per_byte";
+			}
+		}
+
+		wcout << endl;
+
+	} else {
+		wcout << L"[" << endl;
+	}
+}
+
+void printResult(Format format, const Codec& codec, int level, wstring type, Result& result, perf::Counters* counters, bool& first) {
+	double megabytes = result.size / 1024.0 / 1024.0;
+	double ratio = result.size == 0 ? 1 : (double) result.compressedSize / result.size;
+	double compressSeconds = median(result.compressSeconds);
+	double decompressSeconds = median(result.decompressSeconds);
+
+	//0 if nothing was timed, e.g. decompression of a type that is never compressed
+	double compressSpeed = compressSeconds > 0 ? megabytes / compressSeconds : 0;
+	double decompressSpeed = decompressSeconds > 0 ? result.decompressedSize / 1024.0 / 1024.0 / decompressSeconds : 0;
+
+	if(format == TEXT) {
+		wcout << left << setw(9) << codec.encoder << setw(9) << codec.matcher << right << setw(5) << level << L"  " << left << setw(10) << type;
+		wcout << right << setw(9) << result.entries << fixed << setprecision(1) << setw(16) << compressSpeed << setw(17) << decompressSpeed;
+		wcout << setprecision(4) << setw(10) << ratio;
+
+		if(counters) {
+			for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+				if(counters->available((perf::Counter) i)) {
+					wcout << setprecision(3) << setw(12) << median(result.counters[i]) / result.size;
+				} else {
+					wcout << setw(12) << L"n/a";
+				}
+			}
+		}
+
+		if(result.errors > 0) {
+			wcout << L"  " << result.errors << L" errors";
+		}
+
+		wcout << endl;
+
+	} else if(format == CSV) {
+		wcout << codec.encoder << L"," << codec.matcher << L"," << level << L"," << type << L"," << result.entries << L",";
+		wcout << result.size << L"," << result.compressedSize << L"," << fixed << setprecision(4) << ratio << L",";
+		wcout << setprecision(2) << compressSpeed << L"," << decompressSpeed << L"," << result.compressSeconds.size() << L"," << result.errors;
+
+		if(counters) {
+			for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+				wcout << L",";
+
+				if(counters->available((perf::Counter) i)) {
+					wcout << setprecision(4) << median(result.counters[i]) / result.size;
+				}
+			}
+		}
+
+		wcout << endl;
+
+	} else {
+		wcout << (first ? L"" : L",\n");
+		wcout << L"  {\"encoder\": \"" << codec.encoder << L"\", \"matcher\": \"" << codec.matcher << L"\", \"level\": " << level;
+		wcout << L", \"type\": \"" << type << L"\", \"entries\": " << result.entries << L", \"size\": " << result.size;
+		wcout << L", \"compressed_size\": " << result.compressedSize << L", \"ratio\": " << fixed << setprecision(4) << ratio;
+		wcout << L", \"compress_mbs\": " << setprecision(2) << compressSpeed << L", \"decompress_mbs\": " << decompressSpeed;
+		wcout << L", \"runs\": " << result.compressSeconds.size() << L", \"errors\": " << result.errors;
+
+		if(counters) {
+			for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+				wcout << L", \"" << perf::COUNTER_NAMES[i] << L"_per_byte\": ";
+
+				if(counters->available((perf::Counter) i)) {
+					wcout << setprecision(4) << median(result.counters[i]) / result.size;
+				} else {
+					wcout << L"null";
+				}
+			}
+		}
+
+		wcout << L"}";
+	}
+
+	first = false;
+}
+
+int wmain(int argc, wchar_t *argv[]) {
+	initConsole();
+
+	if(argc == 1) {
+		wcout << L"qfs-bench.exe -args package_file_or_folder" << endl;
+		wcout << L"  -l  compression level, 1 to 9 or max (default: all levels)" << endl;
+		wcout << L"  -e  encoder, lazy, optimal, or fast (default: all)" << endl;
+		wcout << L"  -m  matcher, chain, dual, bt, hash, p-chain, p-multi, or p-map (default: all)" << endl;
+		wcout << L"  -r  number of runs, the speeds are their medians (default: 3)" << endl;
+		wcout << L"  -f  output format, text, csv, or json (default: text)" << endl;
+		wcout << L"  -p  hardware performance counters per byte, Linux only" << endl;
+		wcout << L"  -b  check that batch compression gives the same output as compressing the entries one at a time, instead of the benchmark" << endl;
+		wcout << L"  -k  check that every match length kernel gives the same output as the scalar kernel, instead of the benchmark" << endl;
+		wcout << endl;
+		return 0;
+	}
+
+	int minLevel = QFS_MIN_LEVEL;
+	int maxLevel = QFS_MAX_LEVEL;
+	wstring encoder;
+	wstring matcher;
+	int runs = 3;
+	Format format = TEXT;
+	bool usePerf = false;
+	bool batch = false;
+	bool kernels = false;
+	int fileArgIndex = 1;
+
+	while(fileArgIndex < argc - 1 && argv[fileArgIndex][0] == L'-') {
+		wstring arg = argv[fileArgIndex];
+
+		if(arg == L"-p") {
+			usePerf = true;
+			fileArgIndex++;
+			continue;
+		}
+
+		if(arg == L"-b") {
+			batch = true;
+			fileArgIndex++;
+			continue;
+		}
+
+		if(arg == L"-k") {
+			kernels = true;
+			fileArgIndex++;
+			continue;
+		}
+
+		wstring value = argv[++fileArgIndex];
+
+		if(arg == L"-l") {
+			if(value == L"max") {
+				minLevel = maxLevel = QFS_MAX_LEVEL;
+			} else if(value.size() == 1 && value[0] >= L'0' + QFS_MIN_LEVEL && value[0] <= L'9') {
+				minLevel = maxLevel = value[0] - L'0';
+			} else {
+				wcout << L"Invalid compression level " << value << endl;
+				return 0;
+			}
+
+		} else if(arg == L"-e") {
+			encoder = value;
+
+		} else if(arg == L"-m") {
+			matcher = value;
+
+		} else if(arg == L"-r") {
+			runs = wcstol(value.c_str(), nullptr, 10);
+
+			if(runs < 1) {
+				wcout << L"Invalid number of runs " << value << endl;
+				return 0;
+			}
+
+		} else if(arg == L"-f") {
+			if(value == L"text") {
+				format = TEXT;
+			} else if(value == L"csv") {
+				format = CSV;
+			} else if(value == L"json") {
+				format = JSON;
+			} else {
+				wcout << L"Invalid output format " << value << endl;
+				return 0;
+			}
+
+		} else {
+			wcout << L"Unrecognized argument " << arg << endl;
+			return 0;
+		}
+
+		fileArgIndex++;
+	}
+
+	wstring pathName = argv[fileArgIndex];
+	vector<Sample> samples;
+
+	if(filesystem::is_regular_file(dbpf::toPath(pathName))) {
+		loadEntries(pathName, pathName, samples);
+
+	} else if(filesystem::is_directory(dbpf::toPath(pathName))) {
+		for(auto& dir_entry: filesystem::recursive_directory_iterator(dbpf::toPath(pathName))) {
+			if(dir_entry.is_regular_file() && dir_entry.path().extension() == ".package") {
+				loadEntries(dbpf::toWString(dir_entry.path()), dbpf::toWString(filesystem::relative(dir_entry.path(), dbpf::toPath(pathName))), samples);
+			}
+		}
+
+	} else {
+		wcout << L"File not found" << endl;
+		return 0;
+	}
+
+	if(format == TEXT) {
+		unsigned long long totalSize = 0;
+
+		for(auto& sample: samples) {
+			totalSize += sample.content.size();
+		}
+
+		wcout << samples.size() << L" entries, " << fixed << setprecision(2) << totalSize / 1024.0 / 1024.0 << L" MB, " << runs << L" runs" << endl << endl;
+	}
+
+	//single thread, so that the numbers only depend on the codec
+	qfs_context context;
+
+	//compress with each engine and level both ways, the matchers in practice/ are not engines of qfs_compress_batch
+	if(batch) {
+		uint mismatches = 0;
+
+		for(auto& codec: CODECS) {
+			if(!isSelected(codec, encoder, matcher) || codec.engine == -1) {
+				continue;
+			}
+
+			for(int level = minLevel; level <= maxLevel; level++) {
+				uint codecMismatches = checkBatch(context, codec, level, samples);
+				mismatches += codecMismatches;
+
+				wcout << left << setw(9) << codec.encoder << setw(9) << codec.matcher << right << setw(5) << level << L"  ";
+				wcout << (codecMismatches == 0 ? L"same output" : to_wstring(codecMismatches) + L" entries differ") << endl;
+			}
+		}
+
+		return mismatches > 0 ? 1 : 0;
+	}
+
+	//compress with the scalar kernel, then with each of the other kernels that the CPU supports, nothing else is compressing while the kernel is switched
+	if(kernels) {
+		uint mismatches = 0;
+
+		for(int kernel = QFS_KERNEL_WORD; kernel <= QFS_KERNEL_AVX2; kernel++) {
+			if(!qfs_get_kernel(kernel)) {
+				wcout << KERNEL_NAMES[kernel] << L" kernel is not available on this CPU" << endl;
+			}
+		}
+
+		for(auto& codec: CODECS) {
+			if(!isSelected(codec, encoder, matcher)) {
+				continue;
+			}
+
+			for(int level = minLevel; level <= maxLevel; level++) {
+				qfs_use_kernel(QFS_KERNEL_SCALAR);
+				vector<bytes> expected = compressSamples(context, codec, level, samples);
+
+				for(int kernel = QFS_KERNEL_WORD; kernel <= QFS_KERNEL_AVX2; kernel++) {
+					if(!qfs_get_kernel(kernel)) {
+						continue;
+					}
+
+					uint kernelMismatches = checkKernel(context, codec, level, samples, kernel, expected);
+					mismatches += kernelMismatches;
+
+					wcout << left << setw(9) << codec.encoder << setw(9) << codec.matcher << right << setw(5) << level << L"  " << left << setw(8) << KERNEL_NAMES[kernel] << right;
+					wcout << (kernelMismatches == 0 ? L"same output" : to_wstring(kernelMismatches) + L" entries differ") << endl;
+				}
+			}
+		}
+
+		return mismatches > 0 ? 1 : 0;
+	}
+	perf::Counters perfCounters;
+	perf::Counters* counters = nullptr;
+
+	if(usePerf) {
+		if(perfCounters.available()) {
+			counters = &perfCounters;
+		} else {
+			wcerr << L"Performance counters are not available, continuing without them" << endl;
+		}
+	}
+
+	printHeader(format, counters);
+	bool first = true;
+
+	for(auto& codec: CODECS) {
+		if(!isSelected(codec, encoder, matcher)) {
+			continue;
+		}
+
+		for(int level = minLevel; level <= maxLevel; level++) {
+			Result total;
+			map<uint, Result> types;
+
+			for(auto& sample: samples) {
+				Result& result = types[sample.type];
+				result.entries++;
+				result.size += sample.content.size();
+				total.entries++;
+				total.size += sample.content.size();
+			}
+
+			for(int run = 0; run < runs; run++) {
+				for(auto& type: types) {
+					type.second.compressSeconds.push_back(0);
+					type.second.decompressSeconds.push_back(0);
+
+					for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+						type.second.counters[i].push_back(0);
+					}
+				}
+
+				for(auto& sample: samples) {
+					Result& result = types[sample.type];
+					bytes buffer = bytes(sample.content.size());
+					bytes output = bytes(sample.content.size());
+
+					double before[perf::COUNTER_COUNT], after[perf::COUNTER_COUNT];
+
+					if(counters) {
+						counters->read(before);
+					}
+
+					auto start = chrono::steady_clock::now();
+					int length = codec.compress(context, sample.content, buffer, level);
+					auto middle = chrono::steady_clock::now();
+
+					if(counters) {
+						counters->read(after);
+
+						for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+							result.counters[i].back() += after[i] - before[i];
+						}
+					}
+
+					//incompressible entries are stored as they are
+					//the decompression is timed from here, so that it doesn't include reading the counters
+					if(length > 0) {
+						auto decompressStart = chrono::steady_clock::now();
+						bool success = qfs_decompress(buffer.data(), length, output.data(), output.size(), false);
+						result.decompressSeconds.back() += chrono::duration<double>(chrono::steady_clock::now() - decompressStart).count();
+
+						if(run == 0 && (!success || output != sample.content)) {
+							result.errors++;
+						}
+					}
+
+					result.compressSeconds.back() += chrono::duration<double>(middle - start).count();
+
+					if(run == 0) {
+						result.compressedSize += length > 0 ? length : sample.content.size();
+						result.decompressedSize += length > 0 ? sample.content.size() : 0;
+					}
+				}
+			}
+
+			for(auto& type: types) {
+				total.compressedSize += type.second.compressedSize;
+				total.decompressedSize += type.second.decompressedSize;
+				total.errors += type.second.errors;
+			}
+
+			for(int run = 0; run < runs; run++) {
+				total.compressSeconds.push_back(0);
+				total.decompressSeconds.push_back(0);
+
+				for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+					total.counters[i].push_back(0);
+				}
+
+				for(auto& type: types) {
+					total.compressSeconds.back() += type.second.compressSeconds[run];
+					total.decompressSeconds.back() += type.second.decompressSeconds[run];
+
+					for(int i = 0; i < perf::COUNTER_COUNT; i++) {
+						total.counters[i].back() += type.second.counters[i][run];
+					}
+				}
+			}
+
+			printResult(format, codec, level, L"all", total, counters, first);
+
+			for(auto& type: types) {
+				printResult(format, codec, level, typeName(type.first), type.second, counters, first);
+			}
+		}
+	}
+
+	if(format == JSON) {
+		wcout << endl << L"]" << endl;
+	} else {
+		wcout << endl;
+	}
+
+	return 0;
+}
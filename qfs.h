@@ -11,12 +11,37 @@
 #include <string.h>  // for memcpy and memset
 #include <stdlib.h>
 
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+  #define QFS_X86
+  #include <immintrin.h>  // SSE2 and AVX2 match length kernels
+  #ifdef _MSC_VER
+    #include <intrin.h>   // __cpuid and _xgetbv
+  #endif
+#endif
+
 //#include <assert.h>
 #define assert(expr) do{}while(0)
 	
 static bool qfs_decompress(const unsigned char* src, int compressed_size, unsigned char* dst, int uncompressed_size, bool truncate);
-static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst);
-static unsigned char* _compress(const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad);
+static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst, int level, int engine);
+class qfs_context;
+static int qfs_compress(qfs_context& ctx, const unsigned char* src, int srclen, unsigned char* dst, int level, int engine);
+static inline void qfs_compress_batch(qfs_context& ctx, int count, const unsigned char* const* srcs, const int* srclens, unsigned char* const* dsts, int* dstlens, int level, int engine);
+static unsigned char* qfs_compress_level(qfs_context& ctx, const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad, int level, int engine);
+static int qfs_compress_parallel(const unsigned char* src, int srclen, unsigned char* dst, int level, int engine, int segment_size);
+static bool qfs_is_compressible(const unsigned char* src, int srclen);
+
+/*
+ * Compression engines
+ * QFS_ENGINE_CHAIN:   zlib style lazy matching on hash chains
+ * QFS_ENGINE_OPTIMAL: price based optimal parsing on hash chains, slower but smaller
+ * QFS_ENGINE_FAST:    greedy matching with a single probe hash table, for quick first passes
+ * QFS_ENGINE_DUAL:    lazy matching like QFS_ENGINE_CHAIN with separate near and far hash chains
+ * QFS_ENGINE_BT:      lazy matching with a binary tree match finder, holds up on repetitive data
+ * QFS_ENGINE_OPTIMAL_BT: optimal parsing with the binary tree match finder, the smallest output
+ */
+
+enum qfs_engine { QFS_ENGINE_CHAIN, QFS_ENGINE_OPTIMAL, QFS_ENGINE_FAST, QFS_ENGINE_DUAL, QFS_ENGINE_BT, QFS_ENGINE_OPTIMAL_BT };
 
 // datatype assumptions: 8-bit bytes; sizeof(int) >= 4
 
@@ -64,6 +89,33 @@ struct dbpf_compressed_file_header  // 9 bytes
 
 #define DBPF_COMPRESSION_QFS (0xFB10)
 
+/*
+ * Copies for the fast decompression loop. They copy whole chunks, so they
+ * can write up to one chunk past dst+len, and they are only correct for
+ * overlapping copies if dst-src is at least the chunk size.
+ */
+static inline void wildcopy8(unsigned char* dst, const unsigned char* src, int len) {
+    unsigned char* end = dst + len;
+    do { memcpy(dst, src, 8); dst += 8; src += 8; } while (dst < end);
+}
+
+static inline void wildcopy16(unsigned char* dst, const unsigned char* src, int len) {
+    unsigned char* end = dst + len;
+    do { memcpy(dst, src, 16); dst += 16; src += 16; } while (dst < end);
+}
+
+static inline void wildcopy32(unsigned char* dst, const unsigned char* src, int len) {
+    unsigned char* end = dst + len;
+    do { memcpy(dst, src, 32); dst += 32; src += 32; } while (dst < end);
+}
+
+/*
+ * Room needed for the largest command plus the overrun of the wildcopies:
+ * a command reads at most 4 + 112 bytes, and writes at most 3 + 1028.
+ */
+#define FAST_SRC_MARGIN (4 + 112 + 32)
+#define FAST_DST_MARGIN (3 + 1028 + 32)
+
 static bool qfs_decompress(const unsigned char* src, int compressed_size, unsigned char* dst, int uncompressed_size, bool truncate) {
     const unsigned char* src_end = src + compressed_size;
     unsigned char* dst_end = dst + uncompressed_size;
@@ -87,6 +139,76 @@ static bool qfs_decompress(const unsigned char* src, int compressed_size, unsign
 
     src += sizeof(dbpf_compressed_file_header);
 
+    /*
+     * Fast loop: while there is room for any command and the overrun of the
+     * wildcopies, only the offsets have to be checked. The rest of the data
+     * goes through the careful loop below.
+     */
+    if (src_end - src > FAST_SRC_MARGIN && dst_end - dst > FAST_DST_MARGIN) {
+        const unsigned char* src_fast_end = src_end - FAST_SRC_MARGIN;
+        unsigned char* dst_fast_end = dst_end - FAST_DST_MARGIN;
+
+        while (src < src_fast_end && dst < dst_fast_end) {
+            int lit, copy, offset;
+            unsigned b0 = *src++;
+            if (b0 < 0x80) {
+                unsigned b1 = *src++;
+                lit = b0 & 0x03;
+                copy = ((b0 & 0x1C) >> 2) + 3;
+                offset = ((b0 & 0x60) << 3) + b1 + 1;
+            } else if (b0 < 0xC0) {
+                unsigned b1 = *src++;
+                unsigned b2 = *src++;
+                lit = (b1 & 0xC0) >> 6;
+                copy = (b0 & 0x3F) + 4;
+                offset = ((b1 & 0x3F) << 8) + b2 + 1;
+            } else if (b0 < 0xE0) {
+                unsigned b1 = *src++;
+                unsigned b2 = *src++;
+                unsigned b3 = *src++;
+                lit = b0 & 0x03;
+                copy = ((b0 & 0x0C) << 6) + b3 + 5;
+                offset = ((b0 & 0x10) << 12) + (b1 << 8) + b2 + 1;
+            } else if (b0 < 0xFC) {
+                lit = (b0 - 0xDF) * 4;
+                wildcopy16(dst, src, lit);
+                dst += lit; src += lit;
+                continue;
+            } else {
+                lit = b0 - 0xFC;
+                copy = 0;
+                offset = 0;
+            }
+
+            memcpy(dst, src, 4);  // at most 3 literals
+            dst += lit; src += lit;
+
+            if (!copy)
+                continue;
+            if (offset > dst - dst_start)
+                return false;
+
+            if (offset >= 32) {
+                wildcopy32(dst, dst - offset, copy);
+            } else if (offset >= 16) {
+                wildcopy16(dst, dst - offset, copy);
+            } else if (offset >= 8) {
+                wildcopy8(dst, dst - offset, copy);
+            } else if (offset == 1) {
+                memset(dst, dst[-1], copy);
+            } else {
+                /* Expand the pattern to 8 bytes, then copy from the first
+                 * multiple of offset that's at least 8 bytes back */
+                for (int i = 0; i < 8; ++i)
+                    dst[i] = dst[i - offset];
+                int period = offset * ((8 + offset - 1) / offset);
+                if (copy > 8)
+                    wildcopy8(dst + 8, dst + 8 - period, copy - 8);
+            }
+            dst += copy;
+        }
+    }
+
     unsigned b0;
     do {
         int lit, copy, offset;
@@ -160,11 +282,16 @@ static bool qfs_decompress(const unsigned char* src, int compressed_size, unsign
 }
 
 /*
- * Try to compress the data and return the result in a buffer (which the
- * caller must delete). If it's uncompressable, return NULL.
+ * Try to compress the data into dst (which must hold at least srclen-1
+ * bytes) using the given compression level (QFS_MIN_LEVEL..QFS_MAX_LEVEL)
+ * and engine (qfs_engine). Returns the compressed size, or 0 if it's
+ * uncompressable.
+ *
+ * The version without a qfs_context allocates the tables on every call,
+ * use a qfs_context per thread when compressing many buffers.
  */
  
-static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst) {
+static int qfs_compress(qfs_context& ctx, const unsigned char* src, int srclen, unsigned char* dst, int level, int engine) {
     // There are only 3 byte for the uncompressed size in the header,
     // so I guess we can only compress files larger than 16MB...
     if (srclen < 14 || srclen >= 16777216) return 0;
@@ -172,7 +299,7 @@ static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst
     // We only want the compressed output if it's smaller than the
     // uncompressed.
 
-    unsigned char* dstend = _compress(src, src+srclen, dst, dst+srclen-1, false);
+    unsigned char* dstend = qfs_compress_level(ctx, src, src+srclen, dst, dst+srclen-1, false, level, engine);
 	
     if (dstend) {
         return dstend - dst;
@@ -186,11 +313,44 @@ static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst
 
 #define MIN_LOOKAHEAD (MAX_MATCH+MIN_MATCH+1)
 
-// corresponds to zlib compression level 5
-#define GOOD_LENGTH 8
-#define MAX_LAZY    16
-#define NICE_LENGTH 32
-#define MAX_CHAIN   32
+/*
+ * Compression levels, taken from zlib's configuration_table. Levels 1-3
+ * use deflate_fast in zlib, here every level goes through the lazy
+ * evaluation in _compress. QFS_MAX_LEVEL goes beyond zlib's level 9 since
+ * QFS matches can be up to 1028 bytes long.
+ *
+ * good_length: reduce lazy search above this match length
+ * max_lazy:    do not perform lazy search above this match length
+ * nice_length: quit search above this match length
+ * max_chain:   maximum number of hash chain entries to visit
+ *
+ * The parameters are compile time constants so that each level gets its own
+ * copy of longest_match and _compress.
+ */
+
+#define QFS_MIN_LEVEL     1
+#define QFS_MAX_LEVEL     10
+#define QFS_DEFAULT_LEVEL 5
+
+template<int level> struct qfs_level;
+
+#define QFS_LEVEL(level, good, lazy, nice, chain) \
+    template<> struct qfs_level<level> { \
+        enum { number = level, good_length = good, max_lazy = lazy, nice_length = nice, max_chain = chain }; \
+    };
+
+QFS_LEVEL(1,     4,    4,    8,     4)
+QFS_LEVEL(2,     4,    5,   16,     8)
+QFS_LEVEL(3,     4,    6,   32,    32)
+QFS_LEVEL(4,     4,    4,   16,    16)
+QFS_LEVEL(5,     8,   16,   32,    32)
+QFS_LEVEL(6,     8,   16,  128,   128)
+QFS_LEVEL(7,     8,   32,  128,   256)
+QFS_LEVEL(8,    32,  128,  258,  1024)
+QFS_LEVEL(9,    32,  258,  258,  4096)
+QFS_LEVEL(10, 1028, 1028, 1028, 16384)
+
+#undef QFS_LEVEL
 
 #define HASH_BITS 16
 #define HASH_SIZE 65536
@@ -201,6 +361,166 @@ static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst
 #define MAX_DIST W_SIZE
 #define W_MASK (W_SIZE-1)
 
+/*
+ * Match length kernels: count the equal bytes at a and b, up to max. Only
+ * max bytes are read from each side, wide loads are done while at least
+ * that many bytes are left and the rest is compared one byte at a time.
+ * All kernels give the same result, the fastest one supported by the CPU
+ * is chosen at startup.
+ */
+
+enum qfs_kernel { QFS_KERNEL_SCALAR, QFS_KERNEL_WORD, QFS_KERNEL_SSE2, QFS_KERNEL_AVX2 };
+
+#if defined(QFS_X86) || defined(_M_ARM64) || (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+  #define QFS_LITTLE_ENDIAN
+#endif
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+  static inline unsigned ctz64(unsigned long long x) { unsigned long i; _BitScanForward64(&i, x); return i; }
+  static inline unsigned ctz32(unsigned x)           { unsigned long i; _BitScanForward(&i, x); return i; }
+#elif defined(_MSC_VER)
+  static inline unsigned ctz32(unsigned x)           { unsigned long i; _BitScanForward(&i, x); return i; }
+  static inline unsigned ctz64(unsigned long long x) { return (unsigned)x ? ctz32((unsigned)x) : 32 + ctz32((unsigned)(x >> 32)); }
+#else
+  static inline unsigned ctz64(unsigned long long x) { return __builtin_ctzll(x); }
+  static inline unsigned ctz32(unsigned x)           { return __builtin_ctz(x); }
+#endif
+
+static inline unsigned long long load64(const unsigned char* p) {
+    unsigned long long x;
+    memcpy(&x, p, 8);
+    return x;
+}
+
+static inline unsigned load32(const unsigned char* p) {
+    unsigned x;
+    memcpy(&x, p, 4);
+    return x;
+}
+
+static unsigned match_length_scalar(const unsigned char* a, const unsigned char* b, unsigned max) {
+    unsigned len = 0;
+    while (len < max && a[len] == b[len])
+        ++len;
+    return len;
+}
+
+#ifdef QFS_LITTLE_ENDIAN
+/* 8 bytes at a time, the first different byte is the lowest set bit of the xor */
+static unsigned match_length_word(const unsigned char* a, const unsigned char* b, unsigned max) {
+    unsigned len = 0;
+    for (; len + 8 <= max; len += 8) {
+        unsigned long long x = load64(a+len) ^ load64(b+len);
+        if (x)
+            return len + (ctz64(x) >> 3);
+    }
+    return len + match_length_scalar(a+len, b+len, max-len);
+}
+#endif
+
+#ifdef QFS_X86
+static unsigned match_length_sse2(const unsigned char* a, const unsigned char* b, unsigned max) {
+    unsigned len = 0;
+    for (; len + 16 <= max; len += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(a+len));
+        __m128i y = _mm_loadu_si128((const __m128i*)(b+len));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) ^ 0xFFFF;
+        if (mask)
+            return len + ctz32(mask);
+    }
+    return len + match_length_scalar(a+len, b+len, max-len);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+static unsigned match_length_avx2(const unsigned char* a, const unsigned char* b, unsigned max) {
+    unsigned len = 0;
+    for (; len + 32 <= max; len += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(a+len));
+        __m256i y = _mm256_loadu_si256((const __m256i*)(b+len));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (mask)
+            return len + ctz32(mask);
+    }
+    return len + match_length_sse2(a+len, b+len, max-len);
+}
+
+static bool cpu_has_avx2() {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0, avx = (info[2] & (1 << 28)) != 0;
+    if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)  // the OS has to save the YMM registers
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+typedef unsigned (*qfs_match_length_fn)(const unsigned char* a, const unsigned char* b, unsigned max);
+
+/* Returns the kernel function, or NULL if it isn't supported on this CPU */
+static qfs_match_length_fn qfs_get_kernel(int kernel) {
+    switch (kernel) {
+        case QFS_KERNEL_SCALAR: return match_length_scalar;
+#ifdef QFS_LITTLE_ENDIAN
+        case QFS_KERNEL_WORD:   return match_length_word;
+#endif
+#ifdef QFS_X86
+        case QFS_KERNEL_SSE2:   return match_length_sse2;
+        case QFS_KERNEL_AVX2:   return cpu_has_avx2() ? match_length_avx2 : 0;
+#endif
+        default:                return 0;
+    }
+}
+
+static qfs_match_length_fn qfs_best_kernel() {
+    for (int kernel = QFS_KERNEL_AVX2; kernel > QFS_KERNEL_SCALAR; --kernel) {
+        if (qfs_match_length_fn fn = qfs_get_kernel(kernel))
+            return fn;
+    }
+    return match_length_scalar;
+}
+
+static qfs_match_length_fn qfs_match_length_kernel = qfs_best_kernel();
+
+/*
+ * Select a kernel, mostly for benchmarks and testing. Returns false if it
+ * isn't supported. The kernel is a plain global that every compressing
+ * thread reads, so this must not be called while anything is being
+ * compressed.
+ */
+static inline bool qfs_use_kernel(int kernel) {
+    qfs_match_length_fn fn = qfs_get_kernel(kernel);
+    if (fn)
+        qfs_match_length_kernel = fn;
+    return fn != 0;
+}
+
+/*
+ * Most matches are short, so the first 8 bytes are compared inline and the
+ * kernel is only called for longer matches.
+ */
+static inline unsigned match_length(const unsigned char* a, const unsigned char* b, unsigned max) {
+#ifdef QFS_LITTLE_ENDIAN
+    if (max >= 8) {
+        unsigned long long x = load64(a) ^ load64(b);
+        if (x)
+            return ctz64(x) >> 3;
+        return 8 + qfs_match_length_kernel(a+8, b+8, max-8);
+    }
+#endif
+    return qfs_match_length_kernel(a, b, max);
+}
+
 class Hash {
 private:
     unsigned hash;
@@ -220,6 +540,23 @@ public:
 
     int getprev(unsigned pos) const { return prev[pos & W_MASK]; }
 
+    /*
+     * Get ready for the next input. Only head has to be cleared since prev
+     * is always written before it's read. For small inputs it's cheaper to
+     * clear the slots that the input could have touched than all of head.
+     * The hash of a position only depends on the 3 bytes at it.
+     */
+    void clear(const unsigned char* src, unsigned len) {
+        hash = 0;
+        if (len < HASH_SIZE/4) {
+            for (unsigned pos = 0; pos + MIN_MATCH <= len; ++pos)
+                head[((src[pos] << (2*HASH_SHIFT)) ^ (src[pos+1] << HASH_SHIFT) ^ src[pos+2]) & HASH_MASK] = -1;
+        } else {
+            for (int i=0; i<HASH_SIZE; ++i)
+                head[i] = -1;
+        }
+    }
+
     void update(unsigned c) {
         hash = ((hash << HASH_SHIFT) ^ c) & HASH_MASK;
     }
@@ -231,6 +568,73 @@ public:
     }
 };
 
+/*
+ * Hash tables of the dual match finder. QFS can only encode 3 byte matches
+ * up to 1024 bytes back and 4 byte matches up to 16384 bytes back, so 3
+ * byte strings get their own table with chains that only cover the last
+ * 1024 bytes, and the whole window is searched with chains of 4 byte
+ * hashes. Candidates that could never be encoded don't end up in a chain.
+ */
+
+#define SHORT_HASH_BITS 12
+#define SHORT_HASH_SIZE (1 << SHORT_HASH_BITS)
+#define SHORT_DIST 1024
+#define SHORT_MASK (2*SHORT_DIST-1)
+#define LONG_HASH_BITS 16
+#define LONG_HASH_SIZE (1 << LONG_HASH_BITS)
+
+class DualHash {
+public:
+    int *head3, *prev3;     /* 3 byte strings, the last SHORT_DIST bytes */
+    int *head4, *prev4;     /* 4 byte strings, the whole window */
+
+    DualHash() {
+        head3 = mynew<int>(SHORT_HASH_SIZE);
+        prev3 = mynew<int>(SHORT_MASK+1);
+        head4 = mynew<int>(LONG_HASH_SIZE);
+        prev4 = mynew<int>(W_SIZE);
+        for (int i=0; i<SHORT_HASH_SIZE; ++i)
+            head3[i] = -1;
+        for (int i=0; i<LONG_HASH_SIZE; ++i)
+            head4[i] = -1;
+    }
+    ~DualHash() {
+        mydelete(head3);
+        mydelete(prev3);
+        mydelete(head4);
+        mydelete(prev4);
+    }
+
+    static unsigned hash3(const unsigned char* p) {
+        return ((p[0] | (p[1] << 8) | (p[2] << 16)) * 2654435761u) >> (32 - SHORT_HASH_BITS);
+    }
+    static unsigned hash4(const unsigned char* p) {
+        return (load32(p) * 2654435761u) >> (32 - LONG_HASH_BITS);
+    }
+
+    /* Get ready for the next input, same as Hash::clear */
+    void clear(const unsigned char* src, unsigned len) {
+        if (len < SHORT_HASH_SIZE/4) {
+            for (unsigned pos = 0; pos + 3 <= len; ++pos)
+                head3[hash3(src + pos)] = -1;
+        } else {
+            for (int i=0; i<SHORT_HASH_SIZE; ++i)
+                head3[i] = -1;
+        }
+        if (len < LONG_HASH_SIZE/4) {
+            for (unsigned pos = 0; pos + 4 <= len; ++pos)
+                head4[hash4(src + pos)] = -1;
+        } else {
+            for (int i=0; i<LONG_HASH_SIZE; ++i)
+                head4[i] = -1;
+        }
+    }
+
+private:
+    DualHash(const DualHash&);
+    DualHash& operator=(const DualHash&);
+};
+
 class CompressedOutput {
 private:
 
@@ -241,18 +645,17 @@ private:
 
 public:
 
-    CompressedOutput(const unsigned char* src_, unsigned char* dst, unsigned char* dstend_) {
+    CompressedOutput(const unsigned char* src_, unsigned char* dst, unsigned char* dstend_, unsigned srcpos_ = 0) {
         dstpos = dst; dstend = dstend_; src = src_;
-        srcpos = 0;
+        srcpos = srcpos_;
     }
 
     unsigned char* get_end() { return dstpos; }
+    unsigned get_srcpos() { return srcpos; }
 
-    bool emit(unsigned from_pos, unsigned to_pos, unsigned count)
+    /* Emits the literals up to to_pos in runs of 4, the last 0-3 are left for the next command */
+    bool flush(unsigned to_pos)
     {
-        if (count)
-            assert(memcmp(src + from_pos, src + to_pos, count) == 0);
-
         unsigned lit = to_pos - srcpos;
 
         while (lit >= 4) {
@@ -266,6 +669,18 @@ public:
             lit -= amt*4;
         }
 
+        return true;
+    }
+
+    bool emit(unsigned from_pos, unsigned to_pos, unsigned count)
+    {
+        if (count)
+            assert(memcmp(src + from_pos, src + to_pos, count) == 0);
+
+        if (!flush(to_pos))
+            return false;
+
+        unsigned lit = to_pos - srcpos;
         unsigned offset = to_pos - from_pos - 1;
 
         if (count == 0) {
@@ -330,6 +745,7 @@ public:
   (zlib format), rfc1951.txt (deflate format) and rfc1952.txt (gzip format).
 */
 
+template<class Level>
 static inline unsigned longest_match(
     int cur_match,
     const Hash& hash,
@@ -340,9 +756,9 @@ static inline unsigned longest_match(
     unsigned const prev_length,
     unsigned* pmatch_start)
 {
-    unsigned chain_length = MAX_CHAIN;         /* max hash chain length */
+    unsigned chain_length = Level::max_chain;  /* max hash chain length */
     int best_len = prev_length;                /* best match length so far */
-    int nice_match = NICE_LENGTH;              /* stop if match long enough */
+    int nice_match = Level::nice_length;       /* stop if match long enough */
     int limit = pos > MAX_DIST ? pos - MAX_DIST + 1 : 0;
     /* Stop when cur_match becomes < limit. */
 
@@ -357,7 +773,7 @@ static inline unsigned longest_match(
     unsigned char scan_end   = scan[best_len];
 
     /* Do not waste too much time if we already have a good match: */
-    if (prev_length >= GOOD_LENGTH) {
+    if (prev_length >= Level::good_length) {
         chain_length >>= 2;
     }
     /* Do not look for matches beyond the end of the input. This is necessary
@@ -383,8 +799,7 @@ static inline unsigned longest_match(
          */
         assert(scan[2] == match[2]);
 
-        int len = 2;
-        do { ++len; } while (len < max_match && scan[len] == match[len]);
+        int len = MIN_MATCH + match_length(scan+MIN_MATCH, match+MIN_MATCH, max_match-MIN_MATCH);
 
         if (len > best_len) {
             *pmatch_start = cur_match;
@@ -399,23 +814,77 @@ static inline unsigned longest_match(
     return best_len;
 }
 
+/*
+ * The part of the input that an engine compresses. Positions [dict, start)
+ * only go in the hash as a dictionary, [start, end) get compressed. The
+ * stream of a segment that isn't final has no end of data command, the
+ * last 0-3 literals are left over for the next segment instead.
+ */
+struct qfs_segment {
+    unsigned dict, start, end;
+    bool final;
+    unsigned leftover;
+};
+
+/* Starts the rolling hash and inserts the dictionary of the segment */
+
+static void _start_segment(Hash& hash, const unsigned char* src, const qfs_segment& seg) {
+    hash.update(src[seg.dict]);
+    hash.update(src[seg.dict+1]);
+
+    for (unsigned pos = seg.dict; pos < seg.start; ++pos) {
+        hash.update(src[pos + MIN_MATCH-1]);
+        hash.insert(pos);
+    }
+}
+
+/* Emits the remaining literals, returns the end of the compressed data or NULL */
+
+static unsigned char* _end_segment(CompressedOutput& compressed_output, unsigned pos, qfs_segment& seg) {
+    if (seg.final) {
+        if (!compressed_output.emit(pos, pos, 0))
+            return 0;
+        seg.leftover = 0;
+    } else {
+        if (!compressed_output.flush(pos))
+            return 0;
+        seg.leftover = pos - compressed_output.get_srcpos();
+    }
+
+    return compressed_output.get_end();
+}
+
+/* Writes the header in front of the compressed data at dst+9, returns the end of the compressed data */
+
+static unsigned char* _finish(unsigned char* dstsize, const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad) {
+    if (pad && dstsize < dstend) {
+        memset(dstsize, 0xFC, dstend-dstsize);
+        dstsize = dstend;
+    }
+
+    dbpf_compressed_file_header* hdr = (dbpf_compressed_file_header*)dst;
+    put(hdr->compressed_size, dstsize - dst);
+    put(hdr->compression_id, DBPF_COMPRESSION_QFS);
+    put(hdr->uncompressed_size, srcend-src);
+
+    return dstsize;
+}
+
 /* Returns the end of the compressed data if successful, or NULL if we overran the output buffer */
 
-static unsigned char* _compress(const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad) {
+template<class Level, class Finder>
+static unsigned char* _compress(Finder& finder, const unsigned char* src, qfs_segment& seg, unsigned char* dst, unsigned char* dstend) {
 	
     unsigned match_start = 0;
     unsigned match_length = MIN_MATCH-1;           /* length of best match */
     bool match_available = false;         /* set if previous match exists */
 
-    unsigned pos = 0, remaining = srcend - src;
+    const unsigned char* srcend = src + seg.end;
+    unsigned pos = seg.start, remaining = seg.end - seg.start;
 
-    if (remaining >= 16777216) return 0;
+    CompressedOutput compressed_output(src, dst, dstend, seg.start);
 
-    CompressedOutput compressed_output(src, dst+sizeof(dbpf_compressed_file_header), dstend);
-
-    Hash hash;
-    hash.update(src[0]);
-    hash.update(src[1]);
+    finder.start(src, seg);
 
     while (remaining) {
 
@@ -423,16 +892,15 @@ static unsigned char* _compress(const unsigned char* src, const unsigned char* s
         unsigned prev_match = match_start;
         match_length = MIN_MATCH-1;
 
-        int hash_head = -1;
+        bool candidates = false;
 
         if (remaining >= MIN_MATCH) {
-            hash.update(src[pos + MIN_MATCH-1]);
-            hash_head = hash.insert(pos);
+            candidates = finder.insert(pos);
         }
 
-        if (hash_head >= 0 && prev_length < MAX_LAZY && pos - hash_head <= MAX_DIST) {
+        if (candidates && prev_length < Level::max_lazy) {
 
-            match_length = longest_match (hash_head, hash, src, srcend, pos, remaining, prev_length, &match_start);
+            match_length = finder.template longest<Level>(pos, remaining, prev_length, &match_start);
 
             /* If we can't encode it, drop it. */
             if ((match_length <= 3 && pos - match_start > 1024) || (match_length <= 4 && pos - match_start > 16384))
@@ -456,8 +924,7 @@ static unsigned char* _compress(const unsigned char* src, const unsigned char* s
             do {
                 ++pos;
                 if (src+pos <= srcend-MIN_MATCH) {
-                    hash.update(src[pos + MIN_MATCH-1]);
-                    hash.insert(pos);
+                    finder.insert(pos);
                 }
             } while (--prev_length != 0);
             match_available = false;
@@ -470,22 +937,1101 @@ static unsigned char* _compress(const unsigned char* src, const unsigned char* s
             --remaining;
         }
     }
-    assert(pos == srcend - src);
-    if (!compressed_output.emit(pos, pos, 0))
-        return 0;
+    assert(pos == seg.end);
+    return _end_segment(compressed_output, pos, seg);
+}
 
-    unsigned char* dstsize = compressed_output.get_end();
-    if (pad && dstsize < dstend) {
-        memset(dstsize, 0xFC, dstend-dstsize);
-        dstsize = dstend;
+/*
+ * Optimal parsing: instead of choosing matches one at a time, find the
+ * cheapest sequence of literals and copies for a window of up to OPT_WINDOW
+ * positions using the exact sizes of the QFS opcodes, then emit it.
+ *
+ * Every position gets an arrival, which is the cheapest known way to encode
+ * the data up to that position. Arrivals are only kept for the best path,
+ * so the number of literals since the last copy is carried along with it.
+ */
+
+#define OPT_WINDOW 4096
+#define OPT_INFINITY 0x3FFFFFFF
+
+struct qfs_match {
+    unsigned length, distance;
+};
+
+struct qfs_arrival {
+    int price;          /* compressed size up to this position */
+    unsigned litlen;    /* number of literals since the last copy */
+    unsigned length;    /* length of the copy that ends here, 0 for a literal */
+    unsigned distance;  /* distance of that copy */
+};
+
+/*
+ * Binary tree match finder, like BT4 in LZMA. The positions with the same
+ * 4 byte hash form a binary search tree ordered by the strings at them,
+ * which is rebuilt with the new position as its root on every insert.
+ * Walking down from the root visits the strings closest to the new one in
+ * order, so the number of nodes visited stays small on repetitive data
+ * where hash chains get long. Every insert is a full search, the lengths
+ * it finds get longer with each match, so all of them are kept for the
+ * optimal engine. 3 byte matches come from a table of the last position
+ * of each 3 byte string.
+ */
+
+class BinaryTree {
+public:
+    int *head3, *head4;
+    int* son;           /* left and right child of every position in the window */
+    qfs_match* found;   /* matches of the last insert */
+
+    BinaryTree() {
+        head3 = mynew<int>(SHORT_HASH_SIZE);
+        head4 = mynew<int>(LONG_HASH_SIZE);
+        son = mynew<int>(2*W_SIZE);
+        found = mynew<qfs_match>(MAX_MATCH+1);
+        for (int i=0; i<SHORT_HASH_SIZE; ++i)
+            head3[i] = -1;
+        for (int i=0; i<LONG_HASH_SIZE; ++i)
+            head4[i] = -1;
+    }
+    ~BinaryTree() {
+        mydelete(head3);
+        mydelete(head4);
+        mydelete(son);
+        mydelete(found);
     }
 
-    dbpf_compressed_file_header* hdr = (dbpf_compressed_file_header*)dst;
-    put(hdr->compressed_size, dstsize - dst);
-    put(hdr->compression_id, DBPF_COMPRESSION_QFS);
-    put(hdr->uncompressed_size, srcend-src);
+    /* Get ready for the next input, son is always written before it's read */
+    void clear(const unsigned char* src, unsigned len) {
+        if (len < SHORT_HASH_SIZE/4) {
+            for (unsigned pos = 0; pos + 3 <= len; ++pos)
+                head3[DualHash::hash3(src + pos)] = -1;
+        } else {
+            for (int i=0; i<SHORT_HASH_SIZE; ++i)
+                head3[i] = -1;
+        }
+        if (len < LONG_HASH_SIZE/4) {
+            for (unsigned pos = 0; pos + 4 <= len; ++pos)
+                head4[DualHash::hash4(src + pos)] = -1;
+        } else {
+            for (int i=0; i<LONG_HASH_SIZE; ++i)
+                head4[i] = -1;
+        }
+    }
 
-    return dstsize;
+private:
+    BinaryTree(const BinaryTree&);
+    BinaryTree& operator=(const BinaryTree&);
+};
+
+/*
+ * Compressor context, holds the tables of the engines so that they are
+ * allocated once and reused for every input. Not thread safe, each thread
+ * should have its own.
+ */
+class qfs_context {
+public:
+    Hash hash;
+    qfs_arrival* opt;       /* optimal engine, allocated on first use */
+    qfs_match* matches;
+    unsigned* path;
+    unsigned matches_size;
+    unsigned* fast_table;   /* fast engine, allocated on first use */
+    DualHash* dual;         /* dual engine, allocated on first use */
+    BinaryTree* tree;       /* binary tree engines, allocated on first use */
+
+    qfs_context() {
+        opt = 0;
+        matches = 0;
+        path = 0;
+        matches_size = 0;
+        fast_table = 0;
+        dual = 0;
+        tree = 0;
+    }
+    ~qfs_context() {
+        mydelete(opt);
+        mydelete(matches);
+        mydelete(path);
+        mydelete(fast_table);
+        delete dual;
+        delete tree;
+    }
+
+    void alloc_optimal(unsigned max_chain) {
+        if (!opt) {
+            opt = mynew<qfs_arrival>(OPT_WINDOW + MAX_MATCH + 1);
+            path = mynew<unsigned>(OPT_WINDOW + MAX_MATCH + 1);
+        }
+        if (matches_size < max_chain) {
+            mydelete(matches);
+            matches = mynew<qfs_match>(max_chain);
+            matches_size = max_chain;
+        }
+    }
+
+    void alloc_fast();
+
+    void alloc_dual() {
+        if (!dual)
+            dual = new DualHash;
+    }
+
+    void alloc_tree() {
+        if (!tree)
+            tree = new BinaryTree;
+    }
+
+    void clear_fast(const unsigned char* src, unsigned len);
+
+private:
+    qfs_context(const qfs_context&);
+    qfs_context& operator=(const qfs_context&);
+};
+
+/* Size of a copy command, or 0 if it can't be encoded */
+static inline unsigned copy_price(unsigned length, unsigned distance) {
+    if (length <= 10 && distance <= 1024)
+        return 2;
+    if (length >= 4 && length <= 67 && distance <= 16384)
+        return 3;
+    if (length >= 5 && distance <= MAX_DIST)
+        return 4;
+    return 0;
+}
+
+/*
+ * Size of one more literal after litlen literals. The first 0-3 literals
+ * before a copy are free in its opcode, every other group of 4 goes in a
+ * literal run opcode which holds up to 112.
+ */
+static inline unsigned literal_price(unsigned litlen) {
+    ++litlen;
+    return 1 + ((litlen & 3) == 0 && (litlen >> 2) % 28 == 1);
+}
+
+/*
+ * Like longest_match, but records every match that is longer than the
+ * previous one. Since the chain is walked from the closest position,
+ * matches[k] has the smallest distance for lengths up to matches[k].length.
+ */
+template<class Level>
+static inline unsigned find_matches(
+    int cur_match,
+    const Hash& hash,
+    const unsigned char* const src,
+    unsigned const pos,
+    unsigned const remaining,
+    unsigned const prev_length,
+    qfs_match* matches)
+{
+    unsigned chain_length = Level::max_chain;
+    unsigned best_len = MIN_MATCH-1;
+    unsigned nice_match = Level::nice_length;
+    int limit = pos > MAX_DIST ? pos - MAX_DIST + 1 : 0;
+    unsigned n = 0;
+
+    const unsigned char* const scan = src+pos;
+    const unsigned max_match = (remaining < MAX_MATCH) ? remaining : MAX_MATCH;
+
+    /* The previous position had a good match, so this one is likely covered
+     * by it already */
+    if (prev_length >= Level::good_length) {
+        chain_length >>= 2;
+    }
+    if (nice_match > max_match) nice_match = max_match;
+
+    do {
+        const unsigned char* match = src + cur_match;
+
+        if (match[best_len] != scan[best_len] ||
+            match[0]        != scan[0]        ||
+            match[1]        != scan[1])          continue;
+
+        unsigned len = MIN_MATCH + match_length(scan+MIN_MATCH, match+MIN_MATCH, max_match-MIN_MATCH);
+
+        if (len > best_len) {
+            best_len = len;
+            if (copy_price(len, pos - cur_match)) {
+                matches[n].length = len;
+                matches[n].distance = pos - cur_match;
+                ++n;
+            }
+            if (len >= nice_match) break;
+        }
+    } while ((cur_match = hash.getprev(cur_match)) >= limit
+             && --chain_length > 0);
+
+    return n;
 }
 
-#endif
\ No newline at end of file
+/*
+ * Match finders for _compress and _compress_optimal. A finder has
+ *
+ *   void start(const unsigned char* src, const qfs_segment& seg);
+ *   bool insert(unsigned pos);
+ *   template<class Level> unsigned longest(unsigned pos, unsigned remaining, unsigned prev_length, unsigned* match_start);
+ *   template<class Level> unsigned all(unsigned pos, unsigned remaining, unsigned prev_length, qfs_match* matches);
+ *
+ * start() inserts the dictionary of the segment, insert(pos) adds a
+ * position and returns true if it has candidates, and longest() searches
+ * the candidates of the position that was inserted last. longest() returns
+ * prev_length or less if it doesn't find anything longer, matches that
+ * can't be encoded are dropped by the caller. Finders for the optimal
+ * engine also have all(), which stores at most Level::max_chain + 1
+ * matches like find_matches. qfs_compress_finder runs finders from outside
+ * of this file.
+ */
+
+/* zlib's hash chains of 3 byte strings over the whole window */
+class ChainFinder {
+private:
+    Hash& hash;
+    const unsigned char* src;
+    const unsigned char* srcend;
+    int head;
+
+public:
+    ChainFinder(Hash& hash_) : hash(hash_) {}
+
+    void start(const unsigned char* src_, const qfs_segment& seg) {
+        src = src_;
+        srcend = src_ + seg.end;
+        _start_segment(hash, src, seg);
+    }
+
+    bool insert(unsigned pos) {
+        hash.update(src[pos + MIN_MATCH-1]);
+        head = hash.insert(pos);
+        return head >= 0 && pos - head <= MAX_DIST;
+    }
+
+    template<class Level>
+    unsigned longest(unsigned pos, unsigned remaining, unsigned prev_length, unsigned* match_start) {
+        return longest_match<Level>(head, hash, src, srcend, pos, remaining, prev_length, match_start);
+    }
+
+    template<class Level>
+    unsigned all(unsigned pos, unsigned remaining, unsigned prev_length, qfs_match* matches) {
+        return find_matches<Level>(head, hash, src, pos, remaining, prev_length, matches);
+    }
+};
+
+/* The short and long chains of DualHash, each walked up to max_chain entries */
+class DualFinder {
+private:
+    DualHash& tables;
+    const unsigned char* src;
+    unsigned end;
+    int head3, head4;
+
+public:
+    DualFinder(DualHash& tables_) : tables(tables_) {}
+
+    void start(const unsigned char* src_, const qfs_segment& seg) {
+        src = src_;
+        end = seg.end;
+        for (unsigned pos = seg.dict; pos < seg.start; ++pos)
+            insert(pos);
+    }
+
+    bool insert(unsigned pos) {
+        unsigned h = DualHash::hash3(src + pos);
+        head3 = tables.prev3[pos & SHORT_MASK] = tables.head3[h];
+        tables.head3[h] = pos;
+
+        head4 = -1;
+        if (pos + 4 <= end) {
+            h = DualHash::hash4(src + pos);
+            head4 = tables.prev4[pos & W_MASK] = tables.head4[h];
+            tables.head4[h] = pos;
+        }
+
+        return (head3 >= 0 && pos - head3 <= SHORT_DIST) || (head4 >= 0 && pos - head4 < MAX_DIST);
+    }
+
+    template<class Level>
+    unsigned longest(unsigned pos, unsigned remaining, unsigned prev_length, unsigned* match_start) {
+        unsigned chain_length = Level::max_chain;
+        unsigned best_len = prev_length;
+        unsigned nice_match = Level::nice_length;
+        const unsigned char* const scan = src + pos;
+
+        if (best_len >= remaining)
+            return remaining;
+
+        const unsigned max_match = (remaining < MAX_MATCH) ? remaining : MAX_MATCH;
+
+        if (prev_length >= Level::good_length)
+            chain_length >>= 2;
+        if (nice_match > remaining)
+            nice_match = remaining;
+
+        /* Near candidates, any length from 3 up can be encoded */
+        int limit = pos > SHORT_DIST ? pos - SHORT_DIST : 0;
+        unsigned count = chain_length;
+
+        for (int cur = head3; cur >= limit && count > 0; cur = tables.prev3[cur & SHORT_MASK], --count) {
+            const unsigned char* match = src + cur;
+
+            if (match[best_len]   != scan[best_len]   ||
+                match[best_len-1] != scan[best_len-1] ||
+                match[0]          != scan[0]          ||
+                match[1]          != scan[1]          ||
+                match[2]          != scan[2])            continue;
+
+            unsigned len = MIN_MATCH + match_length(scan+MIN_MATCH, match+MIN_MATCH, max_match-MIN_MATCH);
+
+            if (len > best_len) {
+                *match_start = cur;
+                best_len = len;
+                if (len >= nice_match) return best_len;
+            }
+        }
+
+        /* Far candidates need 4 bytes, or 5 beyond 16384. The near ones were
+         * all seen already unless the short chain was cut off */
+        int near = count > 0 ? limit : pos;
+        limit = pos > MAX_DIST ? pos - MAX_DIST + 1 : 0;
+        count = chain_length;
+
+        for (int cur = head4; cur >= limit && count > 0; cur = tables.prev4[cur & W_MASK], --count) {
+            if (cur >= near)
+                continue;
+
+            const unsigned char* match = src + cur;
+
+            /* index of the byte that has to match for the copy to be encodable and longer */
+            unsigned last = pos - cur > 16384 ? 4 : 3;
+            if (last < best_len)
+                last = best_len;
+            if (last >= max_match)
+                continue;
+
+            if (match[last] != scan[last] || load32(match) != load32(scan))
+                continue;
+
+            unsigned len = 4 + match_length(scan+4, match+4, max_match-4);
+
+            if (len > last) {
+                *match_start = cur;
+                best_len = len;
+                if (len >= nice_match) break;
+            }
+        }
+
+        return best_len;
+    }
+};
+
+/*
+ * Match finder on a BinaryTree, searches at most max_chain nodes and
+ * compares up to nice_length bytes. Only the longest match is extended
+ * past that, and only when it's asked for, since most inserts are for
+ * positions inside of matches that don't need the result.
+ */
+#define SHORT_LIMIT 16
+
+template<class Level>
+class TreeFinder {
+private:
+    BinaryTree& tree;
+    const unsigned char* src;
+    unsigned end;
+    unsigned count;
+    bool extend;        /* the longest match reached len_limit */
+
+    void extend_longest(unsigned pos) {
+        if (!extend) return;
+        extend = false;
+
+        unsigned avail = end - pos;
+        unsigned max_match = avail < MAX_MATCH ? avail : MAX_MATCH;
+        qfs_match& longest = tree.found[count-1];
+        const unsigned char* scan = src + pos;
+
+        if (longest.length < max_match)
+            longest.length += match_length(scan+longest.length, scan-longest.distance+longest.length, max_match-longest.length);
+    }
+
+public:
+    TreeFinder(BinaryTree& tree_) : tree(tree_) {}
+
+    void start(const unsigned char* src_, const qfs_segment& seg) {
+        src = src_;
+        end = seg.end;
+        for (unsigned pos = seg.dict; pos < seg.start; ++pos)
+            insert(pos);
+    }
+
+    bool insert(unsigned pos) {
+        const unsigned char* const scan = src + pos;
+        const unsigned avail = end - pos;
+        const unsigned max_match = avail < MAX_MATCH ? avail : MAX_MATCH;
+        const unsigned len_limit = max_match < (unsigned)Level::nice_length ? max_match : (unsigned)Level::nice_length;
+        qfs_match* found = tree.found;
+        unsigned best_len = MIN_MATCH-1;
+
+        count = 0;
+
+        unsigned h = DualHash::hash3(scan);
+        int cur = tree.head3[h];
+        tree.head3[h] = pos;
+
+        /* The tree finds the long matches, this one is only for the short ones it can't */
+        if (cur >= 0 && pos - cur <= SHORT_DIST && src[cur] == scan[0] && src[cur+1] == scan[1] && src[cur+2] == scan[2]) {
+            unsigned short_limit = len_limit < SHORT_LIMIT ? len_limit : SHORT_LIMIT;
+            best_len = MIN_MATCH + match_length(scan+MIN_MATCH, src+cur+MIN_MATCH, short_limit-MIN_MATCH);
+            found[0].length = best_len;
+            found[0].distance = pos - cur;
+            count = 1;
+        }
+
+        if (avail < 4) {
+            extend = false;
+            return count > 0;
+        }
+
+        h = DualHash::hash4(scan);
+        cur = tree.head4[h];
+        tree.head4[h] = pos;
+
+        int* ptr0 = tree.son + ((pos & W_MASK) << 1) + 1;
+        int* ptr1 = tree.son + ((pos & W_MASK) << 1);
+        unsigned len0 = 0, len1 = 0;
+        unsigned depth = Level::max_chain;
+
+        for (;;) {
+            if (cur < 0 || pos - cur >= W_SIZE || depth-- == 0) {
+                *ptr0 = *ptr1 = -1;
+                break;
+            }
+
+            int* pair = tree.son + ((cur & W_MASK) << 1);
+            const unsigned char* match = src + cur;
+            unsigned len = len0 < len1 ? len0 : len1;
+
+            if (match[len] == scan[len]) {
+                if (++len < len_limit)
+                    len += match_length(scan+len, match+len, len_limit-len);
+
+                if (len > best_len && copy_price(len, pos - cur)) {
+                    found[count].length = best_len = len;
+                    found[count].distance = pos - cur;
+                    ++count;
+                }
+
+                /* Same string up to the limit, it takes the place of the old node */
+                if (len == len_limit) {
+                    *ptr1 = pair[0];
+                    *ptr0 = pair[1];
+                    break;
+                }
+            }
+
+            if (match[len] < scan[len]) {
+                *ptr1 = cur;
+                ptr1 = pair + 1;
+                cur = *ptr1;
+                len1 = len;
+            } else {
+                *ptr0 = cur;
+                ptr0 = pair;
+                cur = *ptr0;
+                len0 = len;
+            }
+        }
+
+        extend = count && found[count-1].length == len_limit && len_limit < max_match;
+        return count > 0;
+    }
+
+    template<class L>
+    unsigned longest(unsigned pos, unsigned remaining, unsigned prev_length, unsigned* match_start) {
+        extend_longest(pos);
+
+        if (count == 0 || tree.found[count-1].length <= prev_length)
+            return prev_length;
+
+        *match_start = pos - tree.found[count-1].distance;
+        return tree.found[count-1].length;
+    }
+
+    template<class L>
+    unsigned all(unsigned pos, unsigned remaining, unsigned prev_length, qfs_match* matches) {
+        extend_longest(pos);
+        memcpy(matches, tree.found, count * sizeof(qfs_match));
+        return count;
+    }
+};
+
+template<class Level, class Finder>
+static unsigned char* _compress_optimal(qfs_context& ctx, Finder& finder, const unsigned char* src, qfs_segment& seg, unsigned char* dst, unsigned char* dstend) {
+
+    const unsigned char* srcend = src + seg.end;
+    unsigned pos = seg.start, remaining = seg.end - seg.start;
+    unsigned litlen = 0;
+
+    CompressedOutput compressed_output(src, dst, dstend, seg.start);
+
+    /* One more for the 3 byte match of TreeFinder */
+    ctx.alloc_optimal(Level::max_chain + 1);
+
+    qfs_arrival* opt = ctx.opt;
+    qfs_match* matches = ctx.matches;
+    unsigned* path = ctx.path;
+
+    finder.start(src, seg);
+
+    while (remaining) {
+        unsigned window = remaining < OPT_WINDOW ? remaining : OPT_WINDOW;
+        unsigned last = 0;  /* furthest position with an arrival */
+        unsigned prev_length = 0;  /* longest match at the previous position */
+        unsigned cur;
+
+        opt[0].price = 0;
+        opt[0].litlen = litlen;
+        opt[0].length = 0;
+
+        for (cur = 0; cur < window; ++cur) {
+            unsigned p = pos + cur, rem = remaining - cur;
+
+            if (last < cur+1) {
+                opt[cur+1].price = OPT_INFINITY;
+                last = cur+1;
+            }
+
+            int price = opt[cur].price + literal_price(opt[cur].litlen);
+            if (price < opt[cur+1].price) {
+                opt[cur+1].price = price;
+                opt[cur+1].litlen = opt[cur].litlen + 1;
+                opt[cur+1].length = 0;
+            }
+
+            bool candidates = false;
+
+            if (rem >= MIN_MATCH) {
+                candidates = finder.insert(p);
+            }
+
+            unsigned n = 0;
+
+            if (candidates)
+                n = finder.template all<Level>(p, rem, prev_length, matches);
+
+            prev_length = n ? matches[n-1].length : 0;
+
+            if (n == 0)
+                continue;
+
+            for (; last < cur + matches[n-1].length; ++last)
+                opt[last+1].price = OPT_INFINITY;
+
+            /* Long enough, take the longest match and end the window after it */
+            if (matches[n-1].length >= Level::nice_length) {
+                unsigned length = matches[n-1].length;
+                price = opt[cur].price + copy_price(length, matches[n-1].distance);
+
+                if (price < opt[cur+length].price) {
+                    opt[cur+length].price = price;
+                    opt[cur+length].litlen = 0;
+                    opt[cur+length].length = length;
+                    opt[cur+length].distance = matches[n-1].distance;
+                }
+
+                for (unsigned i = 1; i < length; ++i) {
+                    if (src+p+i <= srcend-MIN_MATCH) {
+                        finder.insert(p+i);
+                    }
+                }
+
+                cur += length;
+                break;
+            }
+
+            /* Try every length of every match, except for the middle of long
+             * matches where the price doesn't change anymore */
+            unsigned length = MIN_MATCH;
+            for (unsigned k = 0; k < n; ++k) {
+                for (; length <= matches[k].length; ++length) {
+                    if (length > 67 && length < matches[k].length)
+                        length = matches[k].length;
+
+                    unsigned cost = copy_price(length, matches[k].distance);
+                    if (!cost)
+                        continue;
+
+                    price = opt[cur].price + cost;
+                    if (price < opt[cur+length].price) {
+                        opt[cur+length].price = price;
+                        opt[cur+length].litlen = 0;
+                        opt[cur+length].length = length;
+                        opt[cur+length].distance = matches[k].distance;
+                    }
+                }
+            }
+        }
+
+        /* Walk back from the end of the window and emit the copies in order */
+        unsigned end = cur, count = 0;
+        litlen = opt[end].litlen;
+
+        while (cur > 0) {
+            if (opt[cur].length) {
+                path[count++] = cur;
+                cur -= opt[cur].length;
+            } else {
+                --cur;
+            }
+        }
+
+        while (count--) {
+            const qfs_arrival& arrival = opt[path[count]];
+            unsigned start = pos + path[count] - arrival.length;
+
+            if (!compressed_output.emit(start - arrival.distance, start, arrival.length))
+                return 0;
+        }
+
+        pos += end;
+        remaining -= end;
+    }
+
+    assert(pos == seg.end);
+    return _end_segment(compressed_output, pos, seg);
+}
+
+/*
+ * Fast engine, a greedy parser in the style of LZ4. Every position gets a
+ * single probe in a direct mapped table of 4 byte hashes, there are no
+ * chains and no lazy matching. The step grows after every miss so that
+ * incompressible regions are skipped through quickly, how fast depends on
+ * the level.
+ */
+
+#define FAST_HASH_BITS 14
+#define FAST_HASH_SIZE (1 << FAST_HASH_BITS)
+#define FAST_SKIP_TRIGGER(level) (3 + (level))
+#define FAST_FULL_INSERT 6
+
+static inline unsigned fast_hash(const unsigned char* p) {
+    return (load32(p) * 2654435761u) >> (32 - FAST_HASH_BITS);
+}
+
+inline void qfs_context::alloc_fast() {
+    if (!fast_table) {
+        fast_table = mynew<unsigned>(FAST_HASH_SIZE);
+        memset(fast_table, 0, FAST_HASH_SIZE * sizeof(unsigned));
+    }
+}
+
+/*
+ * Get ready for the next input. Stale entries would still be checked
+ * against the data, but the output has to depend on the input only. Like
+ * Hash::clear, small inputs only clear the slots they could have touched.
+ */
+inline void qfs_context::clear_fast(const unsigned char* src, unsigned len) {
+    if (!fast_table) return;
+
+    if (len < FAST_HASH_SIZE/4) {
+        for (unsigned pos = 0; pos + 4 <= len; ++pos)
+            fast_table[fast_hash(src + pos)] = 0;
+    } else {
+        memset(fast_table, 0, FAST_HASH_SIZE * sizeof(unsigned));
+    }
+}
+
+template<class Level>
+static unsigned char* _compress_fast(qfs_context& ctx, const unsigned char* src, qfs_segment& seg, unsigned char* dst, unsigned char* dstend) {
+
+    const unsigned skip_trigger = FAST_SKIP_TRIGGER(Level::number);
+    unsigned pos, misses = 0;
+
+    CompressedOutput compressed_output(src, dst, dstend, seg.start);
+
+    ctx.alloc_fast();
+    unsigned* table = ctx.fast_table;
+
+    for (pos = seg.dict; pos < seg.start; ++pos)
+        table[fast_hash(src + pos)] = pos;
+
+    pos = seg.start;
+
+    while (pos + 4 <= seg.end) {
+        unsigned h = fast_hash(src + pos);
+        unsigned cand = table[h];
+        table[h] = pos;
+
+        /* Empty slots hold 0, which is just another candidate to check */
+        if (cand >= pos || pos - cand > MAX_DIST || load32(src + cand) != load32(src + pos)) {
+            pos += 1 + (misses++ >> skip_trigger);
+            continue;
+        }
+
+        unsigned remaining = seg.end - pos;
+        unsigned max_match = remaining < MAX_MATCH ? remaining : MAX_MATCH;
+        unsigned length = 4 + match_length(src + pos + 4, src + cand + 4, max_match - 4);
+
+        /* Extend backwards into the pending literals */
+        unsigned lit_start = compressed_output.get_srcpos();
+        while (pos > lit_start && cand > 0 && length < MAX_MATCH && src[pos-1] == src[cand-1]) {
+            --pos;
+            --cand;
+            ++length;
+        }
+
+        /* Far matches need at least 5 bytes */
+        if (!copy_price(length, pos - cand)) {
+            pos += length;
+            continue;
+        }
+
+        if (!compressed_output.emit(cand, pos, length))
+            return 0;
+
+        pos += length;
+        misses = 0;
+
+        /* Insert the positions inside of the match at high levels, otherwise just one near its end as LZ4 does */
+        for (unsigned i = Level::number >= FAST_FULL_INSERT ? pos - length + 1 : pos - 2; i < pos && i + 4 <= seg.end; i += 1)
+            table[fast_hash(src + i)] = i;
+    }
+
+    return _end_segment(compressed_output, seg.end, seg);
+}
+
+/* Runs the engine with the parameters of the level */
+
+template<class Level>
+static unsigned char* _compress_engine(qfs_context& ctx, const unsigned char* src, qfs_segment& seg, unsigned char* dst, unsigned char* dstend, int engine) {
+    switch (engine) {
+        case QFS_ENGINE_OPTIMAL: {
+            ChainFinder finder(ctx.hash);
+            return _compress_optimal<Level>(ctx, finder, src, seg, dst, dstend);
+        }
+        case QFS_ENGINE_FAST:
+            return _compress_fast<Level>(ctx, src, seg, dst, dstend);
+        case QFS_ENGINE_DUAL: {
+            ctx.alloc_dual();
+            DualFinder finder(*ctx.dual);
+            return _compress<Level>(finder, src, seg, dst, dstend);
+        }
+        case QFS_ENGINE_BT: {
+            ctx.alloc_tree();
+            TreeFinder<Level> finder(*ctx.tree);
+            return _compress<Level>(finder, src, seg, dst, dstend);
+        }
+        case QFS_ENGINE_OPTIMAL_BT: {
+            ctx.alloc_tree();
+            TreeFinder<Level> finder(*ctx.tree);
+            return _compress_optimal<Level>(ctx, finder, src, seg, dst, dstend);
+        }
+        default: {
+            ChainFinder finder(ctx.hash);
+            return _compress<Level>(finder, src, seg, dst, dstend);
+        }
+    }
+}
+
+/*
+ * Compresses a segment into a stream without a header, levels outside of
+ * the valid range are clamped. Returns the end of the stream or NULL.
+ */
+
+static unsigned char* qfs_compress_segment(qfs_context& ctx, const unsigned char* src, qfs_segment& seg, unsigned char* dst, unsigned char* dstend, int level, int engine) {
+    unsigned char* end;
+
+    switch (level) {
+        case 1:  end = _compress_engine<qfs_level<1> >(ctx, src, seg, dst, dstend, engine); break;
+        case 2:  end = _compress_engine<qfs_level<2> >(ctx, src, seg, dst, dstend, engine); break;
+        case 3:  end = _compress_engine<qfs_level<3> >(ctx, src, seg, dst, dstend, engine); break;
+        case 4:  end = _compress_engine<qfs_level<4> >(ctx, src, seg, dst, dstend, engine); break;
+        case 5:  end = _compress_engine<qfs_level<5> >(ctx, src, seg, dst, dstend, engine); break;
+        case 6:  end = _compress_engine<qfs_level<6> >(ctx, src, seg, dst, dstend, engine); break;
+        case 7:  end = _compress_engine<qfs_level<7> >(ctx, src, seg, dst, dstend, engine); break;
+        case 8:  end = _compress_engine<qfs_level<8> >(ctx, src, seg, dst, dstend, engine); break;
+        case 9:  end = _compress_engine<qfs_level<9> >(ctx, src, seg, dst, dstend, engine); break;
+        default:
+            if (level < QFS_MIN_LEVEL)
+                end = _compress_engine<qfs_level<QFS_MIN_LEVEL> >(ctx, src, seg, dst, dstend, engine);
+            else
+                end = _compress_engine<qfs_level<QFS_MAX_LEVEL> >(ctx, src, seg, dst, dstend, engine);
+    }
+
+    ctx.hash.clear(src + seg.dict, seg.end - seg.dict);
+    ctx.clear_fast(src + seg.dict, seg.end - seg.dict);
+    if (ctx.dual)
+        ctx.dual->clear(src + seg.dict, seg.end - seg.dict);
+    if (ctx.tree)
+        ctx.tree->clear(src + seg.dict, seg.end - seg.dict);
+    return end;
+}
+
+/* Runs the engine on the whole input and writes the header */
+
+static unsigned char* qfs_compress_level(qfs_context& ctx, const unsigned char* src, const unsigned char* srcend, unsigned char* dst, unsigned char* dstend, bool pad, int level, int engine) {
+    if (srcend - src >= 16777216) return 0;
+
+    qfs_segment seg = { 0, 0, (unsigned)(srcend - src), true, 0 };
+
+    unsigned char* end = qfs_compress_segment(ctx, src, seg, dst+sizeof(dbpf_compressed_file_header), dstend, level, engine);
+    if (!end)
+        return 0;
+
+    return _finish(end, src, srcend, dst, dstend, pad);
+}
+
+/*
+ * Compresses with a match finder from outside of this file, see the match
+ * finders above for what it has to provide. QFS_ENGINE_OPTIMAL runs the
+ * optimal parser on it, any other engine the lazy one. The result is the
+ * same as with qfs_compress.
+ */
+
+template<class Level, class Finder>
+static unsigned char* _compress_finder(qfs_context& ctx, Finder& finder, const unsigned char* src, qfs_segment& seg, unsigned char* dst, unsigned char* dstend, int engine) {
+    if (engine == QFS_ENGINE_OPTIMAL)
+        return _compress_optimal<Level>(ctx, finder, src, seg, dst, dstend);
+    else
+        return _compress<Level>(finder, src, seg, dst, dstend);
+}
+
+template<class Finder>
+static int qfs_compress_finder(qfs_context& ctx, Finder& finder, const unsigned char* src, int srclen, unsigned char* dst, int level, int engine) {
+    if (srclen < 14 || srclen >= 16777216) return 0;
+
+    qfs_segment seg = { 0, 0, (unsigned)srclen, true, 0 };
+    unsigned char* body = dst+sizeof(dbpf_compressed_file_header);
+    unsigned char* dstend = dst+srclen-1;
+    unsigned char* end;
+
+    switch (level) {
+        case 1:  end = _compress_finder<qfs_level<1> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 2:  end = _compress_finder<qfs_level<2> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 3:  end = _compress_finder<qfs_level<3> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 4:  end = _compress_finder<qfs_level<4> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 5:  end = _compress_finder<qfs_level<5> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 6:  end = _compress_finder<qfs_level<6> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 7:  end = _compress_finder<qfs_level<7> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 8:  end = _compress_finder<qfs_level<8> >(ctx, finder, src, seg, body, dstend, engine); break;
+        case 9:  end = _compress_finder<qfs_level<9> >(ctx, finder, src, seg, body, dstend, engine); break;
+        default:
+            if (level < QFS_MIN_LEVEL)
+                end = _compress_finder<qfs_level<QFS_MIN_LEVEL> >(ctx, finder, src, seg, body, dstend, engine);
+            else
+                end = _compress_finder<qfs_level<QFS_MAX_LEVEL> >(ctx, finder, src, seg, body, dstend, engine);
+    }
+
+    if (end)
+        end = _finish(end, src, src+srclen, dst, dstend, false);
+
+    return end ? end - dst : 0;
+}
+
+static int qfs_compress(const unsigned char* src, int srclen, unsigned char* dst, int level, int engine) {
+    qfs_context ctx;
+    return qfs_compress(ctx, src, srclen, dst, level, engine);
+}
+
+/*
+ * Compress count buffers with the same context, for many small inputs.
+ * dsts[i] must hold at least srclens[i]-1 bytes, the compressed sizes are
+ * returned in dstlens (0 if a buffer is uncompressable).
+ */
+
+static inline void qfs_compress_batch(qfs_context& ctx, int count, const unsigned char* const* srcs, const int* srclens, unsigned char* const* dsts, int* dstlens, int level, int engine) {
+    for (int i = 0; i < count; ++i)
+        dstlens[i] = qfs_compress(ctx, srcs[i], srclens[i], dsts[i], level, engine);
+}
+
+/*
+ * Appends the stream of a segment to the ones before it. The segments
+ * before it left carry literals (src[seg.start-carry, seg.start)) that go
+ * in front of its first command, so its leading literal runs and its first
+ * command are encoded again with them, the rest is copied as is.
+ */
+
+static unsigned char* _join_segment(const unsigned char* src, const qfs_segment& seg, unsigned& carry, const unsigned char* stream, const unsigned char* streamend, unsigned char* dst, unsigned char* dstend) {
+    if (carry == 0) {
+        if (dst + (streamend - stream) > dstend) return 0;
+        memcpy(dst, stream, streamend - stream);
+        carry = seg.leftover;
+        return dst + (streamend - stream);
+    }
+
+    CompressedOutput compressed_output(src, dst, dstend, seg.start - carry);
+    unsigned pos = seg.start;
+
+    while (stream < streamend && *stream >= 0xE0 && *stream < 0xFC) {
+        unsigned lit = (*stream - 0xDF) * 4;
+        stream += 1 + lit;
+        pos += lit;
+    }
+
+    if (stream == streamend) {
+        /* Nothing but literals, carry them on to the next segment */
+        pos += seg.leftover;
+        if (!compressed_output.flush(pos)) return 0;
+        carry = pos - compressed_output.get_srcpos();
+        return compressed_output.get_end();
+    }
+
+    unsigned b0 = stream[0], lit, copy = 0, offset = 0, size;
+
+    if (b0 < 0x80) {
+        lit = b0 & 3;
+        copy = ((b0 >> 2) & 7) + 3;
+        offset = ((b0 << 3) & 0x300) + stream[1] + 1;
+        size = 2;
+    } else if (b0 < 0xC0) {
+        lit = stream[1] >> 6;
+        copy = (b0 & 0x3F) + 4;
+        offset = ((stream[1] & 0x3F) << 8) + stream[2] + 1;
+        size = 3;
+    } else if (b0 < 0xE0) {
+        lit = b0 & 3;
+        copy = ((b0 & 0x0C) << 6) + stream[3] + 5;
+        offset = ((b0 & 0x10) << 12) + (stream[1] << 8) + stream[2] + 1;
+        size = 4;
+    } else {
+        lit = b0 & 3;
+        size = 1;
+    }
+
+    pos += lit;
+    if (!compressed_output.emit(pos - offset, pos, copy)) return 0;
+    stream += size + lit;
+
+    unsigned char* end = compressed_output.get_end();
+    if (end + (streamend - stream) > dstend) return 0;
+    memcpy(end, stream, streamend - stream);
+
+    carry = seg.leftover;
+    return end + (streamend - stream);
+}
+
+#define QFS_SEGMENT_SIZE (512*1024)
+
+/*
+ * Segment parallel compression for large inputs. The input is split into
+ * segments of segment_size bytes that are compressed on separate threads
+ * (with OpenMP), each one with the MAX_DIST bytes before it as a
+ * dictionary, and the streams are joined into one. The output is slightly
+ * larger than from qfs_compress since matches can't cross the end of a
+ * segment. Same arguments and return value as qfs_compress.
+ */
+
+static int qfs_compress_parallel(const unsigned char* src, int srclen, unsigned char* dst, int level, int engine, int segment_size) {
+    if (srclen < 14 || srclen >= 16777216) return 0;
+    if (segment_size < 16) segment_size = 16;
+
+    int count = (srclen + segment_size - 1) / segment_size;
+    if (count < 2) return qfs_compress(src, srclen, dst, level, engine);
+
+    /* Worst case, a segment of literals only */
+    int bound = segment_size + segment_size / 112 + 16;
+
+    unsigned char* streams = mynew<unsigned char>(count * bound);
+    unsigned char** ends = mynew<unsigned char*>(count);
+    qfs_segment* segs = mynew<qfs_segment>(count);
+
+    if (!streams || !ends || !segs) {
+        mydelete(streams); mydelete(ends); mydelete(segs);
+        return 0;
+    }
+
+    #pragma omp parallel
+    {
+        qfs_context ctx;
+
+        #pragma omp for schedule(dynamic)
+        for (int i = 0; i < count; ++i) {
+            qfs_segment& seg = segs[i];
+            seg.start = i * segment_size;
+            seg.end = (i == count-1) ? srclen : seg.start + segment_size;
+            seg.dict = seg.start > MAX_DIST ? seg.start - MAX_DIST : 0;
+            seg.final = (i == count-1);
+            seg.leftover = 0;
+
+            unsigned char* stream = streams + i * bound;
+            ends[i] = qfs_compress_segment(ctx, src, seg, stream, stream + bound, level, engine);
+        }
+    }
+
+    unsigned char* dstend = dst + srclen - 1;
+    unsigned char* end = dst + sizeof(dbpf_compressed_file_header);
+    unsigned carry = 0;
+
+    for (int i = 0; i < count && end; ++i)
+        end = ends[i] ? _join_segment(src, segs[i], carry, streams + i * bound, ends[i], end, dstend) : 0;
+
+    if (end)
+        end = _finish(end, src, src+srclen, dst, dstend, false);
+
+    mydelete(streams);
+    mydelete(ends);
+    mydelete(segs);
+
+    return end ? end - dst : 0;
+}
+
+#define QFS_SAMPLE_SIZE 16384
+#define QFS_SAMPLE_COUNT 4
+#define QFS_SAMPLE_HASH_BITS 14
+
+/*
+ * Quick estimate of whether the data is worth compressing, much cheaper
+ * than compressing it. QFS has no entropy coding, so only repeated strings
+ * make the data smaller. A few samples spread over the input are searched
+ * for 4 byte repeats with a single probe hash table, which is first filled
+ * with every 4th position of the window before the sample so that long
+ * distance repeats are found too. The data is considered incompressible if
+ * less than 1/64 of the sampled bytes are covered by repeats, which is the
+ * case for JPEG and PNG images and other compressed formats.
+ */
+
+static bool qfs_is_compressible(const unsigned char* src, int srclen) {
+    unsigned table[1 << QFS_SAMPLE_HASH_BITS];
+    unsigned sampled = 0, covered = 0;
+
+    int count = QFS_SAMPLE_COUNT, size = QFS_SAMPLE_SIZE;
+    if (srclen <= QFS_SAMPLE_COUNT * QFS_SAMPLE_SIZE) {
+        count = 1;
+        size = srclen;
+    }
+
+    for (int k = 0; k < count; ++k) {
+        /* samples are evenly spaced, the last one ends at the end of the input */
+        unsigned start = count > 1 ? (unsigned)((long long)(srclen - size) * k / (count - 1)) : 0;
+        unsigned end = start + size;
+        unsigned pos = start > MAX_DIST ? start - MAX_DIST : 0;
+
+        memset(table, 0, sizeof(table));
+
+        for (; pos + 4 <= start; pos += 4)
+            table[(load32(src + pos) * 2654435761u) >> (32 - QFS_SAMPLE_HASH_BITS)] = pos + 1;
+
+        for (pos = start; pos + 4 <= end;) {
+            unsigned v = load32(src + pos);
+            unsigned h = (v * 2654435761u) >> (32 - QFS_SAMPLE_HASH_BITS);
+            unsigned cand = table[h];
+            table[h] = pos + 1;
+
+            if (cand && load32(src + cand - 1) == v) {
+                unsigned len = 4;
+                while (pos + len < end && src[cand - 1 + len] == src[pos + len])
+                    ++len;
+                covered += len;
+                pos += len;
+            } else {
+                ++pos;
+            }
+        }
+
+        sampled += size;
+    }
+
+    return covered * 64 >= sampled;
+}
+
+#endif
+
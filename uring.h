@@ -0,0 +1,302 @@
+#ifndef URING_H
+#define URING_H
+
+//batches of reads and writes on a file with io_uring, so that a whole window of entries is handed to the kernel with one system call
+//the ring is set up with raw system calls, there is no dependency on liburing
+//on other systems, or when the kernel doesn't allow io_uring (older kernels, seccomp in containers), the ring is just unavailable
+
+#ifdef __linux__
+	#include <linux/io_uring.h>
+	#include <sys/mman.h>
+	#include <sys/syscall.h>
+	#include <unistd.h>
+	#include <errno.h>
+#endif
+
+#include <string.h>
+
+#include <chrono>
+#include <vector>
+
+namespace uring {
+
+	enum Op { READ, WRITE };
+
+	//one read or write of size bytes at offset in the file
+	struct Request {
+		Op op;
+		unsigned long long offset;
+		unsigned char* data;
+		unsigned int size;
+	};
+
+	//what a ring did, for the run statistics
+	struct Stats {
+		unsigned long long requests = 0;
+		unsigned long long submits = 0; //io_uring_enter calls
+		unsigned long long depthSum = 0; //requests in flight after each submit, divided by submits for the average queue depth
+		unsigned int maxDepth = 0;
+		unsigned long long bytes = 0;
+		double seconds = 0; //time spent in run
+	};
+
+	class Ring {
+		private:
+			int ringFd = -1;
+			unsigned int depth = 0;
+
+		#ifdef __linux__
+			void* sqRing = MAP_FAILED;
+			void* cqRing = MAP_FAILED;
+			size_t sqRingSize = 0;
+			size_t cqRingSize = 0;
+			io_uring_sqe* sqes = (io_uring_sqe*) MAP_FAILED;
+
+			unsigned* sqTail;
+			unsigned* sqMask;
+			unsigned* sqArray;
+			unsigned* cqHead;
+			unsigned* cqTail;
+			unsigned* cqMask;
+			io_uring_cqe* cqes;
+		#endif
+
+		public:
+			Stats stats;
+
+			Ring(unsigned int entries = 64) {
+			#ifdef __linux__
+				io_uring_params params;
+				memset(&params, 0, sizeof(params));
+
+				ringFd = syscall(__NR_io_uring_setup, entries, &params);
+				if(ringFd < 0) {
+					ringFd = -1;
+					return;
+				}
+
+				sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+				cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+				//newer kernels map both rings at once
+				if(params.features & IORING_FEAT_SINGLE_MMAP) {
+					sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+				}
+
+				sqRing = mmap(NULL, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+
+				if(params.features & IORING_FEAT_SINGLE_MMAP) {
+					cqRing = sqRing;
+				} else {
+					cqRing = mmap(NULL, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+				}
+
+				sqes = (io_uring_sqe*) mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+
+				if(sqRing == MAP_FAILED || cqRing == MAP_FAILED || sqes == MAP_FAILED) {
+					close();
+					return;
+				}
+
+				unsigned char* sq = (unsigned char*) sqRing;
+				unsigned char* cq = (unsigned char*) cqRing;
+
+				sqTail = (unsigned*) (sq + params.sq_off.tail);
+				sqMask = (unsigned*) (sq + params.sq_off.ring_mask);
+				sqArray = (unsigned*) (sq + params.sq_off.array);
+				cqHead = (unsigned*) (cq + params.cq_off.head);
+				cqTail = (unsigned*) (cq + params.cq_off.tail);
+				cqMask = (unsigned*) (cq + params.cq_off.ring_mask);
+				cqes = (io_uring_cqe*) (cq + params.cq_off.cqes);
+
+				depth = params.sq_entries;
+			#endif
+			}
+
+			Ring(const Ring&) = delete;
+			Ring& operator=(const Ring&) = delete;
+
+			~Ring() {
+				close();
+			}
+
+			void close() {
+			#ifdef __linux__
+				if(sqes != MAP_FAILED) {
+					munmap(sqes, depth * sizeof(io_uring_sqe));
+					sqes = (io_uring_sqe*) MAP_FAILED;
+				}
+
+				if(cqRing != MAP_FAILED && cqRing != sqRing) {
+					munmap(cqRing, cqRingSize);
+				}
+
+				if(sqRing != MAP_FAILED) {
+					munmap(sqRing, sqRingSize);
+				}
+
+				sqRing = cqRing = MAP_FAILED;
+
+				if(ringFd != -1) {
+					::close(ringFd);
+					ringFd = -1;
+				}
+			#endif
+			}
+
+			bool available() {
+				return ringFd != -1;
+			}
+
+			//most requests in flight at once
+			unsigned int getDepth() {
+				return depth;
+			}
+
+			/*run all of the requests on the file fd, up to the depth of the ring at once, in any order
+			reads and writes that only did part of their request are continued
+			returns false if a request failed or the kernel doesn't support the operations, then the caller has to do the requests itself*/
+			bool run(int fd, std::vector<Request>& requests) {
+			#ifdef __linux__
+				if(ringFd == -1) {
+					return false;
+				}
+
+				auto start = std::chrono::steady_clock::now();
+
+				//bytes done of each request, requests that were cut short go back in the queue
+				std::vector<unsigned int> done = std::vector<unsigned int>(requests.size(), 0);
+				std::vector<size_t> queue;
+				unsigned int inFlight = 0; //taken by the kernel and not completed yet
+				unsigned int queued = 0; //in the submission ring but not taken by the kernel yet
+				bool success = true;
+
+				//empty requests have nothing to do, and would leave nothing to wait for
+				std::vector<size_t> pending;
+
+				for(size_t i = 0; i < requests.size(); i++) {
+					if(requests[i].size > 0) {
+						pending.push_back(i);
+					}
+				}
+
+				size_t next = 0;
+
+				while(success && (next < pending.size() || !queue.empty() || inFlight + queued > 0)) {
+					unsigned int tail = *sqTail;
+					unsigned int submit = 0;
+
+					while(inFlight + queued + submit < depth && (!queue.empty() || next < pending.size())) {
+						size_t i;
+
+						if(!queue.empty()) {
+							i = queue.back();
+							queue.pop_back();
+						} else {
+							i = pending[next++];
+						}
+
+						Request& request = requests[i];
+						unsigned int index = (tail + submit) & *sqMask;
+						io_uring_sqe& sqe = sqes[index];
+
+						memset(&sqe, 0, sizeof(sqe));
+						sqe.opcode = request.op == READ ? IORING_OP_READ : IORING_OP_WRITE;
+						sqe.fd = fd;
+						sqe.off = request.offset + done[i];
+						sqe.addr = (unsigned long long) (request.data + done[i]);
+						sqe.len = request.size - done[i];
+						sqe.user_data = i;
+
+						sqArray[index] = index;
+						submit++;
+					}
+
+					//the kernel reads the entries after it sees the new tail
+					__atomic_store_n(sqTail, tail + submit, __ATOMIC_RELEASE);
+					queued += submit;
+
+					//the kernel can take fewer entries than it was given, the rest stay in the ring for the next call
+					//only wait when something is in flight, waiting for a completion that can't come never returns
+					unsigned int wait = inFlight + queued > 0 ? 1 : 0;
+					int submitted = syscall(__NR_io_uring_enter, ringFd, queued, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+					if(submitted < 0) {
+						if(errno != EINTR) {
+							success = false;
+							break;
+						}
+
+						submitted = 0;
+					}
+
+					queued -= submitted;
+					inFlight += submitted;
+					stats.submits++;
+					stats.depthSum += inFlight;
+					stats.maxDepth = inFlight > stats.maxDepth ? inFlight : stats.maxDepth;
+
+					unsigned int head = *cqHead;
+
+					while(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+						io_uring_cqe& cqe = cqes[head & *cqMask];
+						size_t i = cqe.user_data;
+						head++;
+						inFlight--;
+
+						if(cqe.res == -EINTR || cqe.res == -EAGAIN) {
+							queue.push_back(i);
+						} else if(cqe.res <= 0) {
+							success = false; //error, or the end of the file before the end of a read
+						} else {
+							done[i] += cqe.res;
+
+							if(done[i] < requests[i].size) {
+								queue.push_back(i);
+							}
+						}
+					}
+
+					__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+				}
+
+				//entries that the kernel didn't take are taken back, so that the next run doesn't submit them
+				if(queued > 0) {
+					__atomic_store_n(sqTail, *sqTail - queued, __ATOMIC_RELEASE);
+				}
+
+				//requests that are still running when one fails still write into the buffers, wait for them
+				while(inFlight > 0) {
+					if(syscall(__NR_io_uring_enter, ringFd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+						break;
+					}
+
+					unsigned int head = *cqHead;
+
+					while(head != __atomic_load_n(cqTail, __ATOMIC_ACQUIRE)) {
+						head++;
+						inFlight--;
+					}
+
+					__atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+				}
+
+				if(success) {
+					stats.requests += pending.size();
+
+					for(auto& request: requests) {
+						stats.bytes += request.size;
+					}
+				}
+
+				stats.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+				return success;
+			#else
+				return false;
+			#endif
+			}
+	};
+
+}
+
+#endif